@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "affinity.h"
+#include "builtins.h"
+#include "exec.h"
+#include "jobs.h"
+
+
+#define AFFINITY_ENV "NUSH_AFFINITY"
+
+#define NODE_DIR "/sys/devices/system/node"
+
+
+enum affinity_policy {
+    AFFINITY_NONE,
+    AFFINITY_ROUND_ROBIN,
+    AFFINITY_NUMA,
+};
+typedef enum affinity_policy affinity_policy;
+
+struct placement {
+    bool pinned;
+    cpu_set_t cpus;
+    int nice; // Added to the shell's niceness
+};
+
+// The CPUs are those the shell could run on when placement started, and the
+// nodes those CPUs split into
+struct affinity_state {
+    affinity_policy policy;
+    bool policy_known;
+    int job_nice;
+
+    bool topology_known;
+    cpu_set_t available;
+    int *cpus;
+    size_t cpu_count;
+    cpu_set_t *nodes;
+    size_t node_count;
+    size_t next;
+
+    // Set in a child that was placed, whose own children inherit it
+    bool placed;
+
+    placement current;
+    cpu_set_t saved;
+    bool swapped;
+};
+typedef struct affinity_state affinity_state;
+
+static affinity_state affinity;
+
+static const char *policy_names[] = {
+    [AFFINITY_NONE] = "none",
+    [AFFINITY_ROUND_ROBIN] = "rr",
+    [AFFINITY_NUMA] = "numa",
+};
+
+
+static bool parse_policy(const char *name, affinity_policy *policy) {
+    for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            *policy = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static affinity_policy current_policy(void) {
+    if (!affinity.policy_known) {
+        char *name = getenv(AFFINITY_ENV);
+        if (!name || !parse_policy(name, &affinity.policy)) {
+            affinity.policy = AFFINITY_NONE;
+        }
+        affinity.policy_known = true;
+    }
+    return affinity.policy;
+}
+
+bool set_affinity_policy(const char *name) {
+    affinity.policy_known = true;
+    return parse_policy(name, &affinity.policy);
+}
+
+void set_job_nice(int increment) {
+    affinity.job_nice = increment;
+}
+
+// Parses a list like the kernel's, such as 0-3,8,10-11
+static bool parse_cpu_list(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    while (*list && *list != '\n') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) {
+            return false;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) {
+                return false;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        list = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0' && *end != '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void add_node(const char *name) {
+    char path[256];
+    snprintf(path, sizeof(path), NODE_DIR "/%s/cpulist", name);
+    FILE *file = fopen(path, "re");
+    if (!file) {
+        return;
+    }
+    char list[1024];
+    cpu_set_t cpus;
+    if (fgets(list, sizeof(list), file) && parse_cpu_list(list, &cpus)) {
+        CPU_AND(&cpus, &cpus, &affinity.available);
+        if (CPU_COUNT(&cpus) > 0) {
+            affinity.nodes = realloc(affinity.nodes, sizeof(cpu_set_t) * (affinity.node_count + 1));
+            affinity.nodes[affinity.node_count++] = cpus;
+        }
+    }
+    fclose(file);
+}
+
+static void load_topology(void) {
+    if (affinity.topology_known) {
+        return;
+    }
+    affinity.topology_known = true;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &affinity.available) == -1) {
+        CPU_ZERO(&affinity.available);
+    }
+    affinity.cpus = malloc(sizeof(int) * (CPU_COUNT(&affinity.available) + 1));
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &affinity.available)) {
+            affinity.cpus[affinity.cpu_count++] = cpu;
+        }
+    }
+
+    DIR *dir = opendir(NODE_DIR);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "node", 4) == 0 &&
+            entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            add_node(entry->d_name);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    // Without NUMA information, the machine is one node
+    if (affinity.node_count == 0) {
+        affinity.nodes = malloc(sizeof(cpu_set_t));
+        affinity.nodes[affinity.node_count++] = affinity.available;
+    }
+}
+
+// Picks the next CPU or node under policy. Returns false if the policy doesn't
+// pin anything.
+static bool next_cpus(affinity_policy policy, cpu_set_t *cpus) {
+    if (policy == AFFINITY_NONE) {
+        return false;
+    }
+    load_topology();
+    if (policy == AFFINITY_ROUND_ROBIN) {
+        if (affinity.cpu_count == 0) {
+            return false;
+        }
+        CPU_ZERO(cpus);
+        CPU_SET(affinity.cpus[affinity.next++ % affinity.cpu_count], cpus);
+    } else {
+        *cpus = affinity.nodes[affinity.next++ % affinity.node_count];
+    }
+    return true;
+}
+
+const placement *next_placement(bool background) {
+    if (affinity.placed) {
+        return NULL;
+    }
+    placement *placement = &affinity.current;
+    placement->pinned = next_cpus(current_policy(), &placement->cpus);
+    placement->nice = background ? affinity.job_nice : 0;
+    return placement->pinned || placement->nice != 0 ? placement : NULL;
+}
+
+placement *policy_placement(const char *name, int increment) {
+    affinity_policy policy;
+    if (!parse_policy(name, &policy)) {
+        return NULL;
+    }
+    placement *placement = malloc(sizeof(struct placement));
+    placement->pinned = next_cpus(policy, &placement->cpus);
+    placement->nice = increment;
+    return placement;
+}
+
+placement *cpu_list_placement(const char *list, int increment) {
+    placement *placement = malloc(sizeof(struct placement));
+    if (!parse_cpu_list(list, &placement->cpus) || CPU_COUNT(&placement->cpus) == 0) {
+        free(placement);
+        return NULL;
+    }
+    placement->pinned = true;
+    placement->nice = increment;
+    return placement;
+}
+
+void free_placement(placement *placement) {
+    free(placement);
+}
+
+static void renice(pid_t pid, int increment) {
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, 0);
+    if (errno == 0) {
+        setpriority(PRIO_PROCESS, pid, nice + increment);
+    }
+}
+
+void begin_placed_spawn(const placement *placement) {
+    affinity.swapped = false;
+    if (!placement || !placement->pinned) {
+        return;
+    }
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &affinity.saved) == 0 &&
+        sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) == 0) {
+        affinity.swapped = true;
+    }
+}
+
+void end_placed_spawn(const placement *placement, pid_t child) {
+    if (affinity.swapped) {
+        sched_setaffinity(0, sizeof(cpu_set_t), &affinity.saved);
+        affinity.swapped = false;
+    }
+    if (placement && placement->nice != 0 && child > 0) {
+        renice(child, placement->nice);
+    }
+}
+
+void apply_placement(const placement *placement) {
+    if (!placement) {
+        return;
+    }
+    if (placement->pinned) {
+        sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus);
+    }
+    if (placement->nice != 0) {
+        renice(0, placement->nice);
+    }
+    affinity.placed = true;
+}
+
+
+// Builtin
+
+static void usage(void) {
+    fprintf(stderr, "Usage: affinity [-p none|rr|numa | -c CPUS] [-n NICE] [COMMAND [ARG]...]\n");
+}
+
+static bool parse_nice(const char *str, int *increment) {
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || value < -40 || value > 40) {
+        return false;
+    }
+    *increment = value;
+    return true;
+}
+
+static int run_placed(char **argv, int in, int out, placement *placement) {
+    // A builtin would run in the shell, which stays where it is
+    if (find_builtin(argv[0])) {
+        fprintf(stderr, "affinity: %s: can't place a builtin\n", argv[0]);
+        return 2;
+    }
+    pid_t child = spawn_placed_process(argv, in, out, placement);
+    if (child == -1) {
+        fprintf(stderr, "affinity: %s: command not found\n", argv[0]);
+        return 127;
+    }
+    int status;
+    pid_t result;
+    do {
+        result = waitpid(child, &status, 0);
+    } while (result == -1 && errno == EINTR);
+    return result == -1 ? 1 : exit_status(status);
+}
+
+// With a command, which can't be a builtin, affinity runs it pinned to the
+// next CPU or node of the given policy, or to the CPUs listed with -c, and at
+// the given niceness. Without one, -p sets the policy for background jobs and
+// pipeline stages, and -n how much nicer background jobs run. With neither,
+// the settings are printed.
+int affinity_command(char **argv, int in, int out) {
+    const char *policy = NULL;
+    const char *cpus = NULL;
+    int increment = 0;
+    bool reniced = false;
+    size_t i = 1;
+    for (; argv[i] && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-p") == 0 && argv[i + 1] && !cpus) {
+            policy = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && argv[i + 1] && !policy) {
+            cpus = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && argv[i + 1] && parse_nice(argv[i + 1], &increment)) {
+            reniced = true;
+            i++;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (!argv[i]) {
+        if (cpus || (policy && !set_affinity_policy(policy))) {
+            usage();
+            return 2;
+        }
+        if (reniced) {
+            set_job_nice(increment);
+        }
+        if (!policy && !reniced) {
+            dprintf(out, "affinity -p %s -n %d\n", policy_names[current_policy()],
+                    affinity.job_nice);
+        }
+        return 0;
+    }
+
+    placement *placement = cpus ? cpu_list_placement(cpus, increment)
+                                : policy_placement(policy ? policy : "none", increment);
+    if (!placement) {
+        usage();
+        return 2;
+    }
+    int status = run_placed(&argv[i], in, out, placement);
+    free_placement(placement);
+    return status;
+}
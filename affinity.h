@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+
+// Where the processes the shell starts run. A policy pins each background job,
+// and each stage of a pipeline, to CPUs of its own: "rr" hands out the CPUs
+// the shell may run on one at a time, and "numa" hands out whole NUMA nodes,
+// so a job's memory stays near it. "none", the default, leaves placement to
+// the kernel. The policy comes from $NUSH_AFFINITY or the affinity builtin,
+// which can also make background jobs nicer and place a single command.
+//
+// A process inherits its placement, so nothing started inside a placed job or
+// stage is placed again.
+
+struct placement;
+typedef struct placement placement;
+
+
+bool set_affinity_policy(const char *name);
+
+// Background jobs run at the shell's niceness plus increment
+void set_job_nice(int increment);
+
+// The placement for the next background job or pipeline stage, or NULL if
+// there's nothing to do. It stays valid until the next call.
+const placement *next_placement(bool background);
+
+// A placement for one command. Returns NULL if the policy or CPU list isn't
+// valid.
+placement *policy_placement(const char *name, int increment);
+placement *cpu_list_placement(const char *list, int increment);
+void free_placement(placement *placement);
+
+// posix_spawn has no attribute for CPU affinity, but a spawned process starts
+// with the mask of the thread that spawned it, so the shell takes on the
+// placement's mask just while spawning. Niceness is set once it has started.
+void begin_placed_spawn(const placement *placement);
+void end_placed_spawn(const placement *placement, pid_t child);
+
+// In a forked child
+void apply_placement(const placement *placement);
+
+// The affinity builtin
+int affinity_command(char **argv, int in, int out);
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "parallel.h"
+#include "parser.h"
+
+
+// Times parse_parallel over a generated script with more and more threads, up
+// to twice the number of cores. Usage: parse_scaling [MEGABYTES]
+
+static const char *lines[] = {
+    "some_command --option=value /path/to/some/file.txt \"quoted arg here\"\n",
+    "first && second || third | filter -x > out.txt\n",
+    "(cd dir; make -j 4 < input) | tee log &\n",
+    "echo one; echo two; echo three\n",
+};
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 16) * 1024 * 1024;
+    char *script = malloc(size + 1);
+    size_t length = 0;
+    for (size_t i = 0; ; i++) {
+        const char *line = lines[i % (sizeof(lines) / sizeof(lines[0]))];
+        size_t line_length = strlen(line);
+        if (length + line_length > size) {
+            break;
+        }
+        memcpy(script + length, line, line_length);
+        length += line_length;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    char *input = malloc(length + 1);
+    double serial = 0;
+    printf("%zu MB, %ld cores\n", length / (1024 * 1024), cores);
+    for (size_t threads = 1; threads <= (size_t) cores * 2; threads *= 2) {
+        // Parsing decodes the input in place, so each run gets a fresh copy
+        memcpy(input, script, length);
+        input[length] = '\0';
+        double start = seconds();
+        parse_tree *tree = parse_parallel(input, length, threads);
+        double elapsed = seconds() - start;
+        free_parse_tree(tree);
+        if (threads == 1) {
+            serial = elapsed;
+        }
+        printf("threads %3zu  %8.3fs  %8.1f MB/s  %5.2fx\n", threads, elapsed,
+               length / elapsed / (1024 * 1024), serial / elapsed);
+    }
+    free(input);
+    free(script);
+    return 0;
+}
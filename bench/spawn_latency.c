@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "exec.h"
+
+
+// Times launching and reaping a trivial command as the shell grows, with the
+// shell's posix_spawn launcher and with fork and exec for comparison.
+// Usage: spawn_latency [MAX_MEGABYTES]
+
+#define LAUNCHES 200
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void reap(pid_t child) {
+    int status;
+    if (child == -1 || waitpid(child, &status, 0) == -1 || status != 0) {
+        fprintf(stderr, "Launch failed\n");
+        exit(1);
+    }
+}
+
+static pid_t fork_exec(char **argv) {
+    pid_t child = fork();
+    if (child == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return child;
+}
+
+int main(int argc, char **argv) {
+    size_t max_size = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+    char *command[] = {"true", NULL};
+    char *memory = NULL;
+
+    printf("%8s  %12s  %12s\n", "RSS MB", "spawn us", "fork us");
+    for (size_t size = 0; size <= max_size; size = size ? size * 4 : 16) {
+        // Touch every page, so the memory really is resident
+        free(memory);
+        memory = malloc(size * 1024 * 1024 + 1);
+        memset(memory, 1, size * 1024 * 1024 + 1);
+
+        double start = seconds();
+        for (size_t i = 0; i < LAUNCHES; i++) {
+            reap(spawn_process(command, STDIN_FILENO, STDOUT_FILENO));
+        }
+        double spawned = (seconds() - start) / LAUNCHES;
+
+        start = seconds();
+        for (size_t i = 0; i < LAUNCHES; i++) {
+            reap(fork_exec(command));
+        }
+        double forked = (seconds() - start) / LAUNCHES;
+
+        printf("%8zu  %12.1f  %12.1f\n", size, spawned * 1e6, forked * 1e6);
+    }
+    free(memory);
+    return 0;
+}
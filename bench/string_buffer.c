@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tokens.h"
+#include "util.h"
+
+
+// Builds multi-megabyte continued commands line by line, the way the REPL
+// does, reusing one string_buffer for every command. Times the pushes alone
+// and then pushing and lexing together. Usage: string_buffer [MEGABYTES]
+
+#define ROUNDS 5
+
+static const char line[] = "some_command --option=value \"quoted arg here\" &&\n";
+static const char last_line[] = "echo done\n";
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 8) * 1024 * 1024;
+    size_t line_count = size / (sizeof(line) - 1);
+    string_buffer *buffer = init_string_buffer();
+
+    double start = seconds();
+    for (size_t round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < line_count; i++) {
+            push_string(buffer, line, sizeof(line) - 1);
+        }
+        push_string(buffer, last_line, sizeof(last_line) - 1);
+        if (string_buffer_contents(buffer)[0] != 's') {
+            return 1;
+        }
+        reset_string_buffer(buffer);
+    }
+    double elapsed = seconds() - start;
+    printf("push        %zu lines x %d: %8.3fs  %8.1f MB/s\n", line_count, ROUNDS, elapsed,
+           (double) size * ROUNDS / elapsed / (1024 * 1024));
+
+    start = seconds();
+    size_t tokens = 0;
+    for (size_t round = 0; round < ROUNDS; round++) {
+        lexer_token_list *list = init_token_list();
+        lexer_context *lexer = init_lexer_resumable();
+        for (size_t i = 0; i <= line_count; i++) {
+            if (i < line_count) {
+                push_string(buffer, line, sizeof(line) - 1);
+            } else {
+                push_string(buffer, last_line, sizeof(last_line) - 1);
+            }
+            lexer_feed(lexer, string_buffer_contents(buffer), string_buffer_length(buffer));
+            if (lex_tokens(lexer, list)) {
+                fprintf(stderr, "Lexing failed\n");
+                return 1;
+            }
+        }
+        if (lexer_needs_input(lexer)) {
+            fprintf(stderr, "Command wasn't complete\n");
+            return 1;
+        }
+        while (consume_token(list)) {
+            tokens++;
+        }
+        free_token_list(list);
+        free_lexer(lexer);
+        reset_string_buffer(buffer);
+    }
+    elapsed = seconds() - start;
+    printf("push + lex  %zu tokens x %d: %8.3fs  %8.1f MB/s\n", tokens / ROUNDS, ROUNDS, elapsed,
+           (double) size * ROUNDS / elapsed / (1024 * 1024));
+
+    free_string_buffer(buffer);
+    return 0;
+}
@@ -0,0 +1,722 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "affinity.h"
+#include "builtins.h"
+#include "exec.h"
+#include "jobs.h"
+#include "map.h"
+#include "mux.h"
+#include "path.h"
+#include "stats.h"
+#include "util.h"
+
+
+struct builtin {
+    const char *name;
+    builtin_function *function;
+};
+typedef struct builtin builtin;
+
+
+// Writes out a builtin's whole output at once, returning status unless the
+// write fails
+static int flush_output(int fd, string_buffer *output, int status) {
+    if (!write_all(fd, string_buffer_contents(output), string_buffer_length(output))) {
+        status = 1;
+    }
+    free_string_buffer(output);
+    return status;
+}
+
+static void push_char(string_buffer *buffer, char c) {
+    push_string(buffer, &c, 1);
+}
+
+
+static int builtin_cd(char **argv, int in, int out) {
+    if (!argv[1]) {
+        return 1;
+    }
+    return chdir(argv[1]) == 0 ? 0 : 1;
+}
+
+static int builtin_exit(char **argv, int in, int out) {
+    exit_shell(argv[1] ? atoi(argv[1]) : 0);
+    return 1;
+}
+
+// hash lists the remembered command paths, hash -r forgets them all, and
+// hash NAME... looks each name up again
+static int builtin_hash(char **argv, int in, int out) {
+    if (!argv[1]) {
+        print_command_hash(out);
+        return 0;
+    }
+    if (strcmp(argv[1], "-r") == 0 && !argv[2]) {
+        clear_command_hash();
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        forget_command(argv[i]);
+        if (!resolve_command(argv[i])) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static int builtin_true(char **argv, int in, int out) {
+    return 0;
+}
+
+static int builtin_false(char **argv, int in, int out) {
+    return 1;
+}
+
+static int builtin_pwd(char **argv, int in, int out) {
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("pwd");
+        return 1;
+    }
+    string_buffer *output = init_string_buffer();
+    push_string(output, cwd, strlen(cwd));
+    push_char(output, '\n');
+    free(cwd);
+    return flush_output(out, output, 0);
+}
+
+// Only -n, to leave off the newline, is taken as an option
+static int builtin_echo(char **argv, int in, int out) {
+    bool newline = true;
+    size_t i = 1;
+    for (; argv[i] && strcmp(argv[i], "-n") == 0; i++) {
+        newline = false;
+    }
+
+    string_buffer *output = init_string_buffer();
+    for (size_t first = i; argv[i]; i++) {
+        if (i > first) {
+            push_char(output, ' ');
+        }
+        push_string(output, argv[i], strlen(argv[i]));
+    }
+    if (newline) {
+        push_char(output, '\n');
+    }
+    return flush_output(out, output, 0);
+}
+
+
+// Jobs
+
+// jobs -l adds process ids, times and resource use
+static int builtin_jobs(char **argv, int in, int out) {
+    bool verbose = argv[1] && strcmp(argv[1], "-l") == 0;
+    sync_output_mux();
+    print_jobs(out, verbose);
+    return 0;
+}
+
+// Operands of wait are process ids unless they start with %. With none, wait
+// waits for every running job. What the jobs wrote is out before wait returns.
+static int builtin_wait(char **argv, int in, int out) {
+    if (!argv[1]) {
+        wait_all_jobs();
+        sync_output_mux();
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        update_jobs();
+        job *job = find_job(argv[i], true);
+        if (job) {
+            status = wait_job(job);
+        } else if (!find_reaped(argv[i], &status)) {
+            fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+            status = 127;
+        }
+    }
+    sync_output_mux();
+    return status;
+}
+
+static int builtin_fg(char **argv, int in, int out) {
+    update_jobs();
+    job *job = find_job(argv[1], false);
+    if (!job) {
+        fprintf(stderr, "fg: %s: no such job\n", argv[1] ? argv[1] : "current");
+        return 1;
+    }
+    int status = foreground_job(job, out);
+    sync_output_mux();
+    return status;
+}
+
+static int resume_job(const char *spec, int out) {
+    job *job = find_job(spec, false);
+    if (!job) {
+        fprintf(stderr, "bg: %s: no such job\n", spec ? spec : "current");
+        return 1;
+    }
+    return background_job(job, out);
+}
+
+static int builtin_bg(char **argv, int in, int out) {
+    update_jobs();
+    if (!argv[1]) {
+        return resume_job(NULL, out);
+    }
+    int status = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        if (resume_job(argv[i], out) != 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+
+// set -j N limits background jobs to N at a time, and set -j 0 lifts the limit.
+// set -o mux sends background jobs' output through the multiplexer, and
+// set -o tag tags its lines with job numbers. +o turns either off.
+static int builtin_set(char **argv, int in, int out) {
+    char *end = NULL;
+    if (argv[1] && strcmp(argv[1], "-j") == 0 && argv[2] && !argv[3]) {
+        unsigned long limit = strtoul(argv[2], &end, 10);
+        if (*argv[2] != '\0' && *end == '\0') {
+            set_job_limit(limit);
+            return 0;
+        }
+    }
+    bool on = argv[1] && strcmp(argv[1], "-o") == 0;
+    bool off = argv[1] && strcmp(argv[1], "+o") == 0;
+    if ((on || off) && argv[2] && !argv[3]) {
+        if (strcmp(argv[2], "mux") == 0) {
+            set_output_mux(on);
+            return 0;
+        }
+        if (strcmp(argv[2], "tag") == 0) {
+            set_output_tags(on);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Usage: set -j JOBS | set -o|+o mux|tag\n");
+    return 2;
+}
+
+// printf
+
+// Decodes the backslash escape at str, which points just past the backslash,
+// and returns where the escape ends. In an argument to %b, octal escapes are
+// written \0NNN and \c ends all output.
+static const char *push_escape(string_buffer *buffer, const char *str, bool argument, bool *stop) {
+    char c = *str;
+    switch (c) {
+        case 'a': push_char(buffer, '\a'); return str + 1;
+        case 'b': push_char(buffer, '\b'); return str + 1;
+        case 'f': push_char(buffer, '\f'); return str + 1;
+        case 'n': push_char(buffer, '\n'); return str + 1;
+        case 'r': push_char(buffer, '\r'); return str + 1;
+        case 't': push_char(buffer, '\t'); return str + 1;
+        case 'v': push_char(buffer, '\v'); return str + 1;
+        case '\\': push_char(buffer, '\\'); return str + 1;
+        case '"': push_char(buffer, '"'); return str + 1;
+        case '\'': push_char(buffer, '\''); return str + 1;
+        case 'c':
+            if (argument) {
+                *stop = true;
+                return str + 1;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (c >= '0' && c <= '7') {
+        if (argument && c == '0') {
+            str++;
+        }
+        int value = 0;
+        for (int digits = 0; digits < 3 && *str >= '0' && *str <= '7'; digits++, str++) {
+            value = value * 8 + (*str - '0');
+        }
+        push_char(buffer, (char) value);
+        return str;
+    }
+
+    // Anything else is left as it was
+    push_char(buffer, '\\');
+    if (c) {
+        push_char(buffer, c);
+        return str + 1;
+    }
+    return str;
+}
+
+// Numeric arguments may also be a quote followed by a character, for its code
+static long long numeric_argument(const char *arg, int *status) {
+    if (!arg) {
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char) arg[1];
+    }
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (end == arg || *end || errno) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+// A conversion's spec is its %, up to MAX_SPEC_FLAGS flags, and a width and a
+// precision of up to MAX_SPEC_NUMBER characters each, any int fitting in that
+#define MAX_SPEC_FLAGS 8
+#define MAX_SPEC_NUMBER 11
+#define SPEC_SIZE (1 + MAX_SPEC_FLAGS + MAX_SPEC_NUMBER + 1 + MAX_SPEC_NUMBER + 1)
+
+// Formats one conversion with the C library, given its flags, width and
+// precision in spec with the conversion still to be appended
+static void push_formatted(string_buffer *buffer, char *spec, size_t spec_length,
+                           const char *length_modifier, char conversion, ...) {
+    char full_spec[64];
+    snprintf(full_spec, sizeof(full_spec), "%.*s%s%c", (int) spec_length, spec, length_modifier, conversion);
+
+    va_list args, copy;
+    va_start(args, conversion);
+    va_copy(copy, args);
+    char small[128];
+    int length = vsnprintf(small, sizeof(small), full_spec, args);
+    if (length >= (int) sizeof(small)) {
+        char *large = malloc(length + 1);
+        vsnprintf(large, length + 1, full_spec, copy);
+        push_string(buffer, large, length);
+        free(large);
+    } else if (length > 0) {
+        push_string(buffer, small, length);
+    }
+    va_end(copy);
+    va_end(args);
+}
+
+// Runs through the format once, consuming arguments as conversions need them.
+// Returns false if output has to stop early.
+static bool format_once(string_buffer *output, const char *format, char ***args, int *status) {
+    bool stop = false;
+    const char *p = format;
+    while (*p && !stop) {
+        if (*p == '\\') {
+            p = push_escape(output, p + 1, false, &stop);
+            continue;
+        }
+        if (*p != '%') {
+            const char *next = p;
+            while (*next && *next != '%' && *next != '\\') {
+                next++;
+            }
+            push_string(output, p, next - p);
+            p = next;
+            continue;
+        }
+        if (p[1] == '%') {
+            push_char(output, '%');
+            p += 2;
+            continue;
+        }
+
+        // Flags, width and precision, with any * taken from the arguments.
+        // Each part is bounded so the whole spec always fits.
+        char spec[SPEC_SIZE];
+        size_t spec_length = 0;
+        bool too_long = false;
+        const char *start = p;
+        spec[spec_length++] = *p++;
+        for (size_t flags = 0; *p && strchr("-+ #0", *p); flags++) {
+            too_long = too_long || flags == MAX_SPEC_FLAGS;
+            if (!too_long) {
+                spec[spec_length++] = *p;
+            }
+            p++;
+        }
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*p != '.') {
+                    break;
+                }
+                spec[spec_length++] = *p++;
+            }
+            if (*p == '*') {
+                p++;
+                long long value = numeric_argument(**args, status);
+                if (**args) {
+                    (*args)++;
+                }
+                if (part == 1 && value < 0) {
+                    // A negative precision is taken as none at all
+                    spec_length--;
+                } else {
+                    spec_length += snprintf(spec + spec_length, sizeof(spec) - spec_length, "%d",
+                                            (int) value);
+                }
+            } else {
+                for (size_t digits = 0; *p >= '0' && *p <= '9'; digits++) {
+                    too_long = too_long || digits == MAX_SPEC_NUMBER;
+                    if (!too_long) {
+                        spec[spec_length++] = *p;
+                    }
+                    p++;
+                }
+            }
+        }
+        if (too_long) {
+            fprintf(stderr, "printf: %.*s: conversion too long\n", (int) (p - start), start);
+            *status = 1;
+            return false;
+        }
+
+        char conversion = *p;
+        const char *arg = **args;
+        if (conversion && strchr("sbcdiouxX", conversion) && arg) {
+            (*args)++;
+        }
+        switch (conversion) {
+            case 's':
+                push_formatted(output, spec, spec_length, "", 's', arg ? arg : "");
+                break;
+            case 'b': ;
+                string_buffer *decoded = init_string_buffer();
+                for (const char *c = arg ? arg : ""; *c && !stop;) {
+                    if (*c == '\\') {
+                        c = push_escape(decoded, c + 1, true, &stop);
+                    } else {
+                        push_char(decoded, *c++);
+                    }
+                }
+                push_formatted(output, spec, spec_length, "", 's', string_buffer_contents(decoded));
+                free_string_buffer(decoded);
+                break;
+            case 'c':
+                push_formatted(output, spec, spec_length, "", 'c', arg ? arg[0] : '\0');
+                break;
+            case 'd':
+            case 'i':
+                push_formatted(output, spec, spec_length, "ll", conversion, numeric_argument(arg, status));
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                push_formatted(output, spec, spec_length, "ll", conversion,
+                               (unsigned long long) numeric_argument(arg, status));
+                break;
+            default:
+                fprintf(stderr, "printf: %%%c: invalid format character\n", conversion);
+                *status = 1;
+                return false;
+        }
+        p++;
+    }
+    return !stop;
+}
+
+// The format is reused for as long as it keeps consuming arguments
+static int builtin_printf(char **argv, int in, int out) {
+    if (!argv[1]) {
+        fprintf(stderr, "printf: usage: printf FORMAT [ARGUMENT]...\n");
+        return 2;
+    }
+
+    string_buffer *output = init_string_buffer();
+    char **args = argv + 2;
+    int status = 0;
+    while (1) {
+        char **start = args;
+        if (!format_once(output, argv[1], &args, &status) || !*args || args == start) {
+            break;
+        }
+    }
+    return flush_output(out, output, status);
+}
+
+
+// test and [
+
+struct test_state {
+    char **args;
+    size_t count;
+    size_t position;
+    bool error;
+};
+typedef struct test_state test_state;
+
+static bool test_error(test_state *test, const char *message, const char *arg) {
+    if (!test->error) {
+        fprintf(stderr, "test: %s%s%s\n", arg ? arg : "", arg ? ": " : "", message);
+    }
+    test->error = true;
+    return false;
+}
+
+static bool is_unary_test(const char *op) {
+    return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghkLnprsStuwxz", op[1]);
+}
+
+static bool is_binary_test(const char *op) {
+    static const char *operators[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL
+    };
+    for (size_t i = 0; operators[i]; i++) {
+        if (strcmp(op, operators[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool test_unary(test_state *test, char op, const char *arg) {
+    struct stat info;
+    switch (op) {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 't': return isatty(atoi(arg));
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        case 'h':
+        case 'L': return lstat(arg, &info) == 0 && S_ISLNK(info.st_mode);
+        default: break;
+    }
+    if (stat(arg, &info) == -1) {
+        return false;
+    }
+    switch (op) {
+        case 'b': return S_ISBLK(info.st_mode);
+        case 'c': return S_ISCHR(info.st_mode);
+        case 'd': return S_ISDIR(info.st_mode);
+        case 'e': return true;
+        case 'f': return S_ISREG(info.st_mode);
+        case 'g': return (info.st_mode & S_ISGID) != 0;
+        case 'k': return (info.st_mode & S_ISVTX) != 0;
+        case 'p': return S_ISFIFO(info.st_mode);
+        case 's': return info.st_size > 0;
+        case 'S': return S_ISSOCK(info.st_mode);
+        case 'u': return (info.st_mode & S_ISUID) != 0;
+        default: return false;
+    }
+}
+
+static long long test_integer(test_state *test, const char *arg) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    if (end == arg || *end || errno) {
+        test_error(test, "integer expression expected", arg);
+    }
+    return value;
+}
+
+// Modification times compared to the nanosecond
+static int compare_mtime(struct stat *left, struct stat *right) {
+    if (left->st_mtim.tv_sec != right->st_mtim.tv_sec) {
+        return left->st_mtim.tv_sec < right->st_mtim.tv_sec ? -1 : 1;
+    }
+    if (left->st_mtim.tv_nsec != right->st_mtim.tv_nsec) {
+        return left->st_mtim.tv_nsec < right->st_mtim.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool test_binary(test_state *test, const char *left, const char *op, const char *right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    } else if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    } else if (strcmp(op, "<") == 0) {
+        return strcmp(left, right) < 0;
+    } else if (strcmp(op, ">") == 0) {
+        return strcmp(left, right) > 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat left_info, right_info;
+        bool has_left = stat(left, &left_info) == 0;
+        bool has_right = stat(right, &right_info) == 0;
+        if (op[1] == 'e') {
+            return has_left && has_right && left_info.st_dev == right_info.st_dev &&
+                   left_info.st_ino == right_info.st_ino;
+        }
+        int order = compare_mtime(&left_info, &right_info);
+        if (op[1] == 'n') {
+            return has_left && (!has_right || order > 0);
+        }
+        return has_right && (!has_left || order < 0);
+    }
+
+    long long a = test_integer(test, left);
+    long long b = test_integer(test, right);
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+static bool test_or(test_state *test);
+
+// A binary operator after an argument always makes a comparison of it, so that
+// arguments that look like operators can still be compared
+static bool test_primary(test_state *test) {
+    char **args = test->args + test->position;
+    size_t left = test->count - test->position;
+    if (left == 0) {
+        return test_error(test, "argument expected", NULL);
+    }
+    if (left >= 3 && is_binary_test(args[1])) {
+        test->position += 3;
+        return test_binary(test, args[0], args[1], args[2]);
+    }
+    if (strcmp(args[0], "(") == 0 && left >= 2) {
+        test->position++;
+        bool result = test_or(test);
+        if (test->position >= test->count || strcmp(test->args[test->position], ")") != 0) {
+            return test_error(test, "')' expected", NULL);
+        }
+        test->position++;
+        return result;
+    }
+    if (left >= 2 && is_unary_test(args[0])) {
+        test->position += 2;
+        return test_unary(test, args[0][1], args[1]);
+    }
+    test->position++;
+    return args[0][0] != '\0';
+}
+
+static bool test_not(test_state *test) {
+    if (test->count - test->position >= 2 && strcmp(test->args[test->position], "!") == 0) {
+        test->position++;
+        return !test_not(test);
+    }
+    return test_primary(test);
+}
+
+static bool test_and(test_state *test) {
+    bool result = test_not(test);
+    while (test->position < test->count && strcmp(test->args[test->position], "-a") == 0) {
+        test->position++;
+        bool right = test_not(test);
+        result = result && right;
+    }
+    return result;
+}
+
+static bool test_or(test_state *test) {
+    bool result = test_and(test);
+    while (test->position < test->count && strcmp(test->args[test->position], "-o") == 0) {
+        test->position++;
+        bool right = test_and(test);
+        result = result || right;
+    }
+    return result;
+}
+
+static int run_test(char **args, size_t count) {
+    if (count == 0) {
+        return 1;
+    }
+    test_state test = { args, count, 0, false };
+    bool result = test_or(&test);
+    if (!test.error && test.position < test.count) {
+        test_error(&test, "too many arguments", test.args[test.position]);
+    }
+    return test.error ? 2 : !result;
+}
+
+static int builtin_test(char **argv, int in, int out) {
+    size_t count = 0;
+    while (argv[count + 1]) {
+        count++;
+    }
+    return run_test(argv + 1, count);
+}
+
+static int builtin_bracket(char **argv, int in, int out) {
+    size_t count = 0;
+    while (argv[count + 1]) {
+        count++;
+    }
+    if (count == 0 || strcmp(argv[count], "]") != 0) {
+        fprintf(stderr, "[: missing ']'\n");
+        return 2;
+    }
+    return run_test(argv + 1, count - 1);
+}
+
+
+static const builtin builtins[] = {
+    { "cd", builtin_cd },
+    { "exit", builtin_exit },
+    { "hash", builtin_hash },
+    { "true", builtin_true },
+    { "false", builtin_false },
+    { "pwd", builtin_pwd },
+    { "echo", builtin_echo },
+    { "printf", builtin_printf },
+    { "test", builtin_test },
+    { "[", builtin_bracket },
+    { "jobs", builtin_jobs },
+    { "wait", builtin_wait },
+    { "fg", builtin_fg },
+    { "bg", builtin_bg },
+    { "set", builtin_set },
+    { "parallel", map_command },
+    { "map", map_command },
+    { "affinity", affinity_command },
+    { "shellstats", shellstats_command },
+};
+
+// Open-addressed, and kept well under half full so lookups rarely probe
+#define BUILTIN_SLOTS 64
+
+static const builtin *slots[BUILTIN_SLOTS];
+static bool slots_filled = false;
+
+static void fill_slots(void) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtin); i++) {
+        size_t slot = hash_string(builtins[i].name) & (BUILTIN_SLOTS - 1);
+        while (slots[slot]) {
+            slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+        }
+        slots[slot] = &builtins[i];
+    }
+    slots_filled = true;
+}
+
+builtin_function *find_builtin(const char *name) {
+    if (!slots_filled) {
+        fill_slots();
+    }
+    size_t slot = hash_string(name) & (BUILTIN_SLOTS - 1);
+    while (slots[slot]) {
+        if (strcmp(slots[slot]->name, name) == 0) {
+            return slots[slot]->function;
+        }
+        slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return NULL;
+}
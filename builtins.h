@@ -0,0 +1,10 @@
+#pragma once
+
+
+// Builtins run in the shell process. They read from in and write to out, which
+// already have the command's redirections applied, and return the command's
+// exit status.
+typedef int builtin_function(char **argv, int in, int out);
+
+// Returns NULL if name isn't a builtin
+builtin_function *find_builtin(const char *name);
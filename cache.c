@@ -0,0 +1,538 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "parser.h"
+#include "program.h"
+#include "util.h"
+
+
+#define CACHE_DIR_ENV "NUSH_CACHE_DIR"
+#define CACHE_SUFFIX ".nushc"
+
+// A miss parses the whole script before any of it runs, rather than streaming
+// it, so bigger scripts are always streamed and never cached
+#define CACHE_MAX_SCRIPT_SIZE (8 * 1024 * 1024)
+
+// Bumped whenever the layout of a cache file or the meaning of a program
+// changes, so entries written by other versions of the shell are ignored
+#define CACHE_MAGIC "nushc\0\0\1"
+#define CACHE_MAGIC_LENGTH 8
+
+
+struct script_cache {
+    char *path;       // Real path of the script
+    char *cache_path; // Where its entry lives
+
+    // The script is mapped to hash it, and copied from the mapping if it has
+    // to be parsed
+    char *source;
+    size_t size;
+    struct timespec mtime;
+    uint64_t hash;
+
+    // Mapped entry and the trees built over it, once loaded
+    void *image;
+    size_t image_size;
+    arena *arena;
+};
+
+// A cache file is a header followed by the script's path and then each table
+// below in turn. Commands are stored in the order the program refers to them,
+// and their arguments and redirections in the same order, so only counts need
+// to be recorded. Strings are stored once however often they're used, and
+// everything in the tables is 32 bits wide, so scripts too big for that are
+// never cached.
+struct cache_header {
+    char magic[CACHE_MAGIC_LENGTH];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+    uint64_t path_length;
+    uint64_t instruction_count;
+    uint64_t command_count;
+    uint64_t argument_count;
+    uint64_t redirection_count;
+    uint64_t strings_length;
+};
+typedef struct cache_header cache_header;
+
+struct cached_instruction {
+    uint32_t op;
+    uint32_t operand; // Jump target, or index of the command
+};
+typedef struct cached_instruction cached_instruction;
+
+// Whether a command is an error tree follows from the instruction using it
+struct cached_command {
+    uint32_t argc;
+    uint32_t redirection_count;
+};
+typedef struct cached_command cached_command;
+
+struct cached_redirection {
+    uint32_t type;
+    uint32_t target; // Offset of the file name in the string table
+};
+typedef struct cached_redirection cached_redirection;
+
+// Arguments are stored as offsets into the string table
+
+struct cache_layout {
+    size_t path;
+    size_t instructions;
+    size_t commands;
+    size_t arguments;
+    size_t redirections;
+    size_t strings;
+    size_t size;
+};
+typedef struct cache_layout cache_layout;
+
+
+static size_t align8(size_t size) {
+    return (size + 7) & ~(size_t) 7;
+}
+
+// Hashes eight bytes at a time, since every warm start hashes the whole script
+static uint64_t hash_bytes(const char *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325 ^ length;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 0x100000001b3;
+    }
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static char *cache_dir(void) {
+    char *dir = getenv(CACHE_DIR_ENV);
+    return dir && *dir ? strdup(dir) : NULL;
+}
+
+// Creates the cache directory and any missing parents
+static void make_cache_dir(const char *cache_path) {
+    char *dir = strdup(cache_path);
+    *strrchr(dir, '/') = '\0';
+    for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, S_IRWXU);
+        *slash = '/';
+    }
+    mkdir(dir, S_IRWXU);
+    free(dir);
+}
+
+script_cache *open_script_cache(const char *filename, int fd) {
+    struct stat info;
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) ||
+        info.st_size > CACHE_MAX_SCRIPT_SIZE) {
+        return NULL;
+    }
+    char *dir = cache_dir();
+    if (!dir) {
+        return NULL;
+    }
+    char *path = realpath(filename, NULL);
+    if (!path) {
+        free(dir);
+        return NULL;
+    }
+
+    char *source = NULL;
+    if (info.st_size > 0) {
+        source = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (source == MAP_FAILED) {
+            free(dir);
+            free(path);
+            return NULL;
+        }
+    }
+
+    script_cache *cache = malloc(sizeof(script_cache));
+    cache->path = path;
+    cache->source = source;
+    cache->size = info.st_size;
+    cache->mtime = info.st_mtim;
+    cache->hash = hash_bytes(source, cache->size);
+    cache->image = NULL;
+    cache->image_size = 0;
+    cache->arena = NULL;
+
+    cache->cache_path = malloc(strlen(dir) + 2 + 16 + strlen(CACHE_SUFFIX) + 1);
+    sprintf(cache->cache_path, "%s/%016llx%s", dir,
+            (unsigned long long) hash_bytes(path, strlen(path)), CACHE_SUFFIX);
+    free(dir);
+    return cache;
+}
+
+void close_script_cache(script_cache *cache) {
+    if (cache->source) {
+        munmap(cache->source, cache->size);
+    }
+    if (cache->image) {
+        munmap(cache->image, cache->image_size);
+    }
+    if (cache->arena) {
+        free_arena(cache->arena);
+    }
+    free(cache->path);
+    free(cache->cache_path);
+    free(cache);
+}
+
+char *copy_script_source(script_cache *cache, size_t *length) {
+    char *copy = malloc(sizeof(char) * cache->size + 1);
+    if (cache->size > 0) {
+        memcpy(copy, cache->source, cache->size);
+    }
+    copy[cache->size] = '\0';
+    *length = cache->size;
+    return copy;
+}
+
+static cache_layout layout_for(const cache_header *header) {
+    cache_layout layout;
+    layout.path = sizeof(cache_header);
+    layout.instructions = layout.path + align8(header->path_length);
+    layout.commands = layout.instructions + sizeof(cached_instruction) * header->instruction_count;
+    layout.arguments = layout.commands + sizeof(cached_command) * header->command_count;
+    layout.redirections = layout.arguments + sizeof(uint32_t) * header->argument_count;
+    layout.strings = layout.redirections + sizeof(cached_redirection) * header->redirection_count;
+    layout.size = layout.strings + header->strings_length;
+    return layout;
+}
+
+static bool header_matches(script_cache *cache, const cache_header *header) {
+    return memcmp(header->magic, CACHE_MAGIC, CACHE_MAGIC_LENGTH) == 0 &&
+           header->size == cache->size &&
+           header->mtime_sec == cache->mtime.tv_sec &&
+           header->mtime_nsec == cache->mtime.tv_nsec &&
+           header->hash == cache->hash &&
+           header->path_length == strlen(cache->path);
+}
+
+// Counts are checked against the file size before any table is read, so a
+// truncated or corrupt entry is simply a miss
+static bool counts_fit(const cache_header *header, size_t size) {
+    size_t limit = size / sizeof(uint32_t);
+    return header->path_length <= size &&
+           header->instruction_count <= limit &&
+           header->command_count <= limit &&
+           header->argument_count <= limit &&
+           header->redirection_count <= limit &&
+           header->strings_length <= size &&
+           layout_for(header).size == size;
+}
+
+// Builds a program whose commands point straight into the mapped string table
+static program *read_program(script_cache *cache, const cache_header *header) {
+    const char *image = cache->image;
+    cache_layout layout = layout_for(header);
+    const cached_instruction *instructions = (const void *) (image + layout.instructions);
+    const cached_command *commands = (const void *) (image + layout.commands);
+    const uint32_t *arguments = (const void *) (image + layout.arguments);
+    const cached_redirection *redirections = (const void *) (image + layout.redirections);
+    char *strings = (char *) image + layout.strings;
+
+    // Every string has to end inside the table
+    if (header->strings_length > 0 && strings[header->strings_length - 1] != '\0') {
+        return NULL;
+    }
+
+    arena *arena = init_arena();
+    parse_tree **trees = malloc(sizeof(parse_tree *) * (header->command_count + 1));
+    size_t next_argument = 0;
+    size_t next_redirection = 0;
+    bool valid = true;
+    for (size_t i = 0; i < header->command_count && valid; i++) {
+        const cached_command *command = &commands[i];
+        if (command->argc == 0 ||
+            command->argc > header->argument_count - next_argument ||
+            command->redirection_count > header->redirection_count - next_redirection) {
+            valid = false;
+            break;
+        }
+
+        parse_tree *tree = arena_alloc(arena, sizeof(parse_tree));
+        tree->type = PARSE_TREE_COMMAND;
+        tree->argc = command->argc;
+        tree->argv = arena_alloc(arena, sizeof(char *) * (command->argc + 1));
+        tree->redirection_count = command->redirection_count;
+        tree->redirections = arena_alloc(arena, sizeof(redir_info) * command->redirection_count);
+        tree->left = NULL;
+        tree->right = NULL;
+        tree->arena = arena;
+
+        for (size_t j = 0; j < command->argc; j++) {
+            uint64_t offset = arguments[next_argument++];
+            valid = valid && offset < header->strings_length;
+            tree->argv[j] = valid ? strings + offset : NULL;
+        }
+        tree->argv[command->argc] = NULL;
+        for (size_t j = 0; j < command->redirection_count; j++) {
+            const cached_redirection *redirection = &redirections[next_redirection++];
+            valid = valid && redirection->target < header->strings_length &&
+                    (redirection->type == REDIR_OUT || redirection->type == REDIR_IN);
+            tree->redirections[j].type = redirection->type;
+            tree->redirections[j].target_filename = valid ? strings + redirection->target : NULL;
+        }
+        trees[i] = tree;
+    }
+
+    program *prog = NULL;
+    if (valid && header->instruction_count > 0) {
+        prog = malloc(sizeof(program));
+        prog->length = header->instruction_count;
+        prog->capacity = header->instruction_count;
+        prog->references = 1;
+        prog->release = NULL;
+        prog->source = NULL;
+        prog->code = malloc(sizeof(instruction) * prog->capacity);
+        for (size_t pc = 0; pc < prog->length && valid; pc++) {
+            const cached_instruction *cached = &instructions[pc];
+            instruction *inst = &prog->code[pc];
+            inst->op = cached->op;
+            switch (cached->op) {
+                case OP_SPAWN:
+                case OP_ERROR:
+                    valid = cached->operand < header->command_count;
+                    inst->command = valid ? trees[cached->operand] : NULL;
+                    if (valid && cached->op == OP_ERROR) {
+                        inst->command->type = PARSE_TREE_ERROR;
+                    }
+                    break;
+                case OP_JUMP_IF_SUCCESS:
+                case OP_JUMP_IF_FAILURE:
+                case OP_BACKGROUND:
+                case OP_SUBSHELL:
+                    // The compiler only jumps forwards, so nothing can loop
+                    valid = cached->operand > pc && cached->operand < prog->length;
+                    inst->target = cached->operand;
+                    break;
+                case OP_PIPE:
+                case OP_WAIT:
+                case OP_EXIT:
+                    inst->target = 0;
+                    break;
+                default:
+                    valid = false;
+                    break;
+            }
+        }
+        // The program must not run off its end
+        valid = valid && prog->code[prog->length - 1].op == OP_EXIT;
+        if (!valid) {
+            free_program(prog);
+            prog = NULL;
+        }
+    }
+    free(trees);
+
+    if (!prog) {
+        free_arena(arena);
+        return NULL;
+    }
+    cache->arena = arena;
+    return prog;
+}
+
+static void release_cache(void *cache) {
+    close_script_cache(cache);
+}
+
+program *load_cached_program(script_cache *cache) {
+    int fd = open(cache->cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1 || info.st_size < (off_t) sizeof(cache_header)) {
+        close(fd);
+        return NULL;
+    }
+    void *image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+    cache->image = image;
+    cache->image_size = info.st_size;
+
+    const cache_header *header = image;
+    program *prog = NULL;
+    if (header_matches(cache, header) && counts_fit(header, info.st_size) &&
+        memcmp((char *) image + sizeof(cache_header), cache->path, header->path_length) == 0) {
+        prog = read_program(cache, header);
+    }
+    if (!prog) {
+        munmap(image, info.st_size);
+        cache->image = NULL;
+        cache->image_size = 0;
+        return NULL;
+    }
+    prog->release = release_cache;
+    prog->source = cache;
+    return prog;
+}
+
+static void count_command(cache_header *header, parse_tree *command) {
+    header->command_count++;
+    header->argument_count += command->argc;
+    header->redirection_count += command->redirection_count;
+    for (size_t i = 0; i < command->argc; i++) {
+        header->strings_length += strlen(command->argv[i]) + 1;
+    }
+    for (size_t i = 0; i < command->redirection_count; i++) {
+        header->strings_length += strlen(command->redirections[i].target_filename) + 1;
+    }
+}
+
+// String table being written, with an open-addressed set of the offsets of the
+// strings already in it. Slots hold offset + 1, so zero is empty.
+struct string_table {
+    char *strings;
+    size_t length;
+    uint32_t *slots;
+    size_t mask;
+};
+typedef struct string_table string_table;
+
+static uint32_t add_string(string_table *table, const char *str) {
+    size_t size = strlen(str) + 1;
+    size_t slot = hash_bytes(str, size) & table->mask;
+    while (table->slots[slot]) {
+        uint32_t offset = table->slots[slot] - 1;
+        if (strcmp(table->strings + offset, str) == 0) {
+            return offset;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+
+    uint32_t offset = table->length;
+    memcpy(table->strings + offset, str, size);
+    table->length += size;
+    table->slots[slot] = offset + 1;
+    return offset;
+}
+
+// Lays the whole entry out in memory so it can be written in one go. Returns
+// NULL if the program is too big for the format.
+static char *build_image(script_cache *cache, program *program, size_t *size) {
+    cache_header header;
+    memset(&header, 0, sizeof(cache_header));
+    memcpy(header.magic, CACHE_MAGIC, CACHE_MAGIC_LENGTH);
+    header.size = cache->size;
+    header.mtime_sec = cache->mtime.tv_sec;
+    header.mtime_nsec = cache->mtime.tv_nsec;
+    header.hash = cache->hash;
+    header.path_length = strlen(cache->path);
+    header.instruction_count = program->length;
+    for (size_t pc = 0; pc < program->length; pc++) {
+        opcode op = program->code[pc].op;
+        if (op == OP_SPAWN || op == OP_ERROR) {
+            count_command(&header, program->code[pc].command);
+        }
+    }
+    // Every count is below the length of the strings before they're shared
+    if (header.strings_length >= UINT32_MAX || header.instruction_count >= UINT32_MAX) {
+        return NULL;
+    }
+
+    // Sized for the strings before they're shared; the file is cut short after
+    cache_layout layout = layout_for(&header);
+    char *image = calloc(layout.size, 1);
+    memcpy(image + layout.path, cache->path, header.path_length);
+
+    string_table table;
+    table.strings = image + layout.strings;
+    table.length = 0;
+    size_t capacity = 16;
+    while (capacity < 2 * (header.argument_count + header.redirection_count)) {
+        capacity = capacity * 2;
+    }
+    table.slots = calloc(capacity, sizeof(uint32_t));
+    table.mask = capacity - 1;
+
+    cached_instruction *instructions = (void *) (image + layout.instructions);
+    cached_command *commands = (void *) (image + layout.commands);
+    uint32_t *arguments = (void *) (image + layout.arguments);
+    cached_redirection *redirections = (void *) (image + layout.redirections);
+    size_t command_count = 0;
+    for (size_t pc = 0; pc < program->length; pc++) {
+        instruction *inst = &program->code[pc];
+        instructions[pc].op = inst->op;
+        if (inst->op != OP_SPAWN && inst->op != OP_ERROR) {
+            instructions[pc].operand = inst->target;
+            continue;
+        }
+
+        parse_tree *tree = inst->command;
+        cached_command *command = &commands[command_count];
+        instructions[pc].operand = command_count++;
+        command->argc = tree->argc;
+        command->redirection_count = tree->redirection_count;
+        for (size_t i = 0; i < tree->argc; i++) {
+            *arguments++ = add_string(&table, tree->argv[i]);
+        }
+        for (size_t i = 0; i < tree->redirection_count; i++) {
+            redirections->type = tree->redirections[i].type;
+            redirections->target = add_string(&table, tree->redirections[i].target_filename);
+            redirections++;
+        }
+    }
+    free(table.slots);
+
+    header.strings_length = table.length;
+    memcpy(image, &header, sizeof(cache_header));
+    *size = layout.strings + table.length;
+    return image;
+}
+
+// Best effort: the entry is written to a temporary file and renamed into place,
+// so concurrent runs never see half of one, and any failure just leaves the
+// script uncached
+void save_cached_program(script_cache *cache, program *program) {
+    size_t size;
+    char *image = build_image(cache, program, &size);
+    if (!image) {
+        return;
+    }
+
+    make_cache_dir(cache->cache_path);
+    char *temp_path = malloc(strlen(cache->cache_path) + 8);
+    sprintf(temp_path, "%s.XXXXXX", cache->cache_path);
+    int fd = mkstemp(temp_path);
+    if (fd != -1) {
+        size_t written = 0;
+        while (written < size) {
+            ssize_t count = write(fd, image + written, size - written);
+            if (count <= 0) {
+                break;
+            }
+            written += count;
+        }
+        close(fd);
+        if (written < size || rename(temp_path, cache->cache_path) == -1) {
+            unlink(temp_path);
+        }
+    }
+
+    free(temp_path);
+    free(image);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "program.h"
+
+
+// Compiled scripts are cached on disk, much like Python's .pyc files. A cache
+// entry is keyed by the script's real path, size, modification time and a hash
+// of its contents, and is ignored as soon as any of them differ.
+//
+// Caching is off unless $NUSH_CACHE_DIR names a directory for the entries.
+// Scripts over a few megabytes are never cached.
+
+struct script_cache;
+typedef struct script_cache script_cache;
+
+
+// Returns NULL if caching is off, or the script isn't a regular file or is too
+// big to cache
+script_cache *open_script_cache(const char *filename, int fd);
+void close_script_cache(script_cache *cache);
+
+// Programs loaded from the cache refer to it, and close it once they are freed
+program *load_cached_program(script_cache *cache);
+void save_cached_program(script_cache *cache, program *program);
+
+// A heap-allocated, null-terminated copy of the script
+char *copy_script_source(script_cache *cache, size_t *length);
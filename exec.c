@@ -1,226 +1,745 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <termios.h>
 #include <unistd.h>
 
 #include <sys/wait.h>
 
+#include "affinity.h"
+#include "builtins.h"
 #include "exec.h"
+#include "jobs.h"
+#include "mux.h"
+#include "path.h"
+#include "program.h"
+#include "stats.h"
+#include "trace.h"
+
 
+// Capacity in bytes to give every pipe, for throughput-heavy pipelines
+#define PIPE_SIZE_ENV "NUSH_PIPE_SIZE"
 
-#define BUILTIN_CD "cd"
-#define BUILTIN_EXIT "exit"
+// Process group handling for the processes started
+#define PGID_INHERIT ((pid_t) -1) // Stay in the shell's group
+#define PGID_NEW 0                // Lead a new group
 
 
 struct execution_context {
     int outfd;
     int infd;
-    bool wait;
 };
 typedef struct execution_context execution_context;
 
+// Set in a child forked to run part of the program, which must leave without
+// running the shell's exit handlers
+static bool forked_child = false;
 
-static bool exec_tree_real(parse_tree *tree, execution_context context);
-
-
-bool is_builtin(char **argv) {
-    return strcmp(argv[0], BUILTIN_CD) == 0 ||
-           strcmp(argv[0], BUILTIN_EXIT) == 0;
-}
 
-static bool builtin_cd(char **argv) {
-    if (!argv[1]) {
-        return false;
+static int spawn_command(pid_t *child, const char *path, posix_spawn_file_actions_t *actions,
+                         posix_spawnattr_t *attributes, char **argv) {
+    if (!path) {
+        return ENOENT;
     }
-    return chdir(argv[1]) == 0;
+    return posix_spawn(child, path, actions, attributes, argv, environ);
 }
 
-static bool builtin_exit(char **argv) {
-    if (argv[1]) {
-        exit(atoi(argv[1]));
+// Starts argv as a child process connected to the context's descriptors, or
+// returns -1 with errno set if it couldn't be started. posix_spawn never copies the shell's
+// address space (glibc starts the child with clone(CLONE_VM | CLONE_VFORK)),
+// so launching stays cheap however large the shell has grown; only subshells,
+// which go on running the program, still need fork. The command is found
+// through the PATH hash, so there is no search on each launch.
+//
+// The child joins the process group pgid, or leads a new one. One that leads
+// a group and is given the terminal takes it as part of being spawned, so it
+// can never read from the terminal before it's in the foreground. It's started
+// where placement puts it, if anywhere.
+static pid_t do_exec(char **argv, execution_context context, pid_t pgid, bool terminal,
+                     const placement *placement) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    if (pgid != PGID_INHERIT) {
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attributes, pgid);
+#ifdef __GLIBC__
+#if __GLIBC__ > 2 || __GLIBC_MINOR__ >= 35
+        if (terminal && pgid == PGID_NEW) {
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+            terminal = false;
+        }
+#endif
+#endif
     }
-    exit(0);
-    return true;
-}
-
-bool exec_builtin(parse_tree *tree) {
-    if (tree->type != PARSE_TREE_COMMAND || !is_builtin(tree->argv)) {
-        return false;
+    if (context.outfd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, context.outfd, STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, context.outfd);
+    }
+    if (context.infd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, context.infd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, context.infd);
     }
 
-    char **argv = tree->argv;
-    char *cmd = tree->argv[0];
-
-    if (!strcmp(cmd, BUILTIN_CD)) {
-        return builtin_cd(argv);
-    } else if (!strcmp(cmd, BUILTIN_EXIT)) {
-        return builtin_exit(argv);
+    pid_t child;
+    begin_placed_spawn(placement);
+    long long start = stats_clock();
+    int error = spawn_command(&child, resolve_command(argv[0]), &actions, &attributes, argv);
+    if (error == ENOENT && forget_command(argv[0])) {
+        // The remembered path has gone away, so search for it again
+        error = spawn_command(&child, resolve_command(argv[0]), &actions, &attributes, argv);
+    }
+    // posix_spawn returns once the child has exec'd
+    if (error == 0) {
+        record_spawn_latency(start);
     }
-    return false;
+    end_placed_spawn(placement, error == 0 ? child : -1);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    if (terminal && pgid == PGID_NEW) {
+        give_terminal(child);
+    }
+    return child;
 }
 
+pid_t spawn_process(char **argv, int infd, int outfd) {
+    return spawn_placed_process(argv, infd, outfd, NULL);
+}
 
-static int do_exec(char **argv, execution_context context) {
-    pid_t child;
-    if((child = fork()) == 0) {
-        // Child process
-        if (context.outfd != STDOUT_FILENO) {
-            dup2(context.outfd, STDOUT_FILENO);
-            close(context.outfd);
-        }
-        if (context.infd != STDIN_FILENO) {
-            dup2(context.infd, STDIN_FILENO);
-            close(context.infd);
-        }
-
-        execvp(argv[0], argv);
-        exit(1);
-    } else {
-        // Parent
-        if (context.wait) {
-            int status;
-            waitpid(child, &status, 0);
-            if (WIFEXITED(status)) {
-                return WEXITSTATUS(status);
-            }
-        }
-    }
-    return 0;
+pid_t spawn_placed_process(char **argv, int infd, int outfd, const placement *placement) {
+    execution_context context = { .outfd = outfd, .infd = infd };
+    return do_exec(argv, context, PGID_INHERIT, false, placement);
 }
 
+// Points the context at the redirection's file. The context owns its
+// descriptors, so whatever it pointed at before is closed. Like pipes, they're
+// close-on-exec, so only the command they're dup'd into place for inherits them.
 static bool apply_redirection(execution_context *context, redir_info *redirection) {
     switch (redirection->type) {
         case REDIR_OUT: ;
-            int outfd = open(redirection->target_filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+            int outfd = open(redirection->target_filename, O_WRONLY | O_CREAT | O_CLOEXEC,
+                         S_IRUSR | S_IWUSR);
             if (outfd == -1) {
                 perror("Error: ");
                 // TODO: Handle errors
                 return false;
             }
+            if (context->outfd != STDOUT_FILENO) {
+                close(context->outfd);
+            }
             context->outfd = outfd;
             break;
         case REDIR_IN: ;
-            int infd = open(redirection->target_filename, O_RDONLY);
+            int infd = open(redirection->target_filename, O_RDONLY | O_CLOEXEC);
             if (infd == -1) {
                 perror("Error: ");
                 // TODO: Handle errors
                 return false;
             }
+            if (context->infd != STDIN_FILENO) {
+                close(context->infd);
+            }
             context->infd = infd;
             break;
     }
     return true;
 }
 
-static bool subshell_exec_tree_real(parse_tree *tree, execution_context context) {
-    pid_t child;
-    execution_context child_context = context;
-    bool wait = context.wait;
-    child_context.wait = true;
-    if ((child = fork()) == 0) {
-        // Child
-        exit(exec_tree_real(tree, child_context) ? 0 : 1);
-    } else {
-        if (context.wait) {
-            int status;
-            waitpid(child, &status, 0);
-            if (WIFEXITED(status)) {
-                return WEXITSTATUS(status) == 0;
-            }
+// Moves the context's descriptors onto stdin and stdout of the process itself
+static void redirect_stdio(execution_context *context) {
+    if (context->outfd != STDOUT_FILENO) {
+        dup2(context->outfd, STDOUT_FILENO);
+        close(context->outfd);
+        context->outfd = STDOUT_FILENO;
+    }
+    if (context->infd != STDIN_FILENO) {
+        dup2(context->infd, STDIN_FILENO);
+        close(context->infd);
+        context->infd = STDIN_FILENO;
+    }
+}
+
+// Replaces the process with argv, found the same way do_exec finds it.
+// Returns only if it couldn't be started.
+static void exec_in_place(char **argv, execution_context *context) {
+    redirect_stdio(context);
+    fflush(NULL);
+    const char *path = resolve_command(argv[0]);
+    if (path) {
+        execve(path, argv, environ);
+    }
+    if ((!path || errno == ENOENT) && forget_command(argv[0])) {
+        path = resolve_command(argv[0]);
+        if (path) {
+            execve(path, argv, environ);
         }
     }
-    return true;
 }
 
+// Reports a command that couldn't be started, and returns the status it has as
+// POSIX shells give it: 127 if it wasn't found, 126 if it couldn't be run
+static int launch_failure(const char *name, int error) {
+    if (error == ENOENT) {
+        fprintf(stderr, "%s: command not found\n", name);
+        return 127;
+    }
+    fprintf(stderr, "%s: %s\n", name, strerror(error));
+    return 126;
+}
 
-static bool exec_tree_real(parse_tree *tree, execution_context context) {
-    if (tree->type == PARSE_TREE_LIST) {
-        exec_tree_real(tree->left, context);
-        if (tree->right) {
-            return exec_tree_real(tree->right, context);
-        }
+// Releases whatever descriptors of the context the shell itself doesn't need
+static void close_context(execution_context context) {
+    if (context.outfd != STDOUT_FILENO) {
+        close(context.outfd);
     }
+    if (context.infd != STDIN_FILENO) {
+        close(context.infd);
+    }
+}
 
-    if (tree->type == PARSE_TREE_OR) {
-        execution_context left_context = context;
-        left_context.wait = true;
-        bool left_status = exec_tree_real(tree->left, left_context);
-        if (!left_status) {
-            return  exec_tree_real(tree->right, context);
-        }
-        return true;
+
+// State of a running program
+struct vm_state {
+    int status;
+
+    // Descriptors for the next process started, and the read end of a pipe
+    // opened for the process after that
+    execution_context context;
+    int next_infd;
+
+    // Processes started since the last OP_WAIT, in order. Ones that couldn't
+    // be started are kept as -1, so they still count as the pipeline's status.
+    // Once waited for, statuses holds the exit status of each.
+    pid_t *pending;
+    int *statuses;
+    size_t pending_count;
+    size_t pending_capacity;
+
+    // Each pipeline the shell itself starts runs in a process group of its
+    // own, led by its first process, and is given the terminal if the shell
+    // has it. Children forked to run part of the program keep everything
+    // they start in their own group, as job control is the shell's alone.
+    // Background lists and stopped pipelines become jobs.
+    bool job_control;
+    bool terminal;
+    pid_t pgid;
+
+    // Where the running pipeline's code starts, to describe it as a job, and
+    // when its first process was started if tracing
+    size_t pipeline_start;
+    long long pipeline_started;
+
+    size_t pipe_size; // 0 leaves pipes at the system default
+
+    bool forked;
+
+    // The process ends along with the program, as in a forked child or the
+    // last program a script runs. Its last command then replaces the process
+    // instead of being started and waited for.
+    bool exits;
+};
+typedef struct vm_state vm_state;
+
+static void reset_context(vm_state *state) {
+    state->context.infd = STDIN_FILENO;
+    state->context.outfd = STDOUT_FILENO;
+    state->next_infd = STDIN_FILENO;
+}
+
+static void init_vm_state(vm_state *state, bool exits) {
+    state->status = 0;
+    reset_context(state);
+    state->pending_count = 0;
+    state->pending_capacity = 8;
+    state->pending = malloc(sizeof(pid_t) * state->pending_capacity);
+    state->statuses = malloc(sizeof(int) * state->pending_capacity);
+    state->job_control = true;
+    state->terminal = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    state->pgid = PGID_NEW;
+    state->pipeline_start = 0;
+    char *pipe_size = getenv(PIPE_SIZE_ENV);
+    state->pipe_size = pipe_size ? strtoul(pipe_size, NULL, 10) : 0;
+    state->forked = false;
+    state->exits = exits;
+}
+
+static void free_vm_state(vm_state *state) {
+    free(state->pending);
+    free(state->statuses);
+}
+
+// Process group for the next process started
+static pid_t next_pgid(vm_state *state) {
+    return state->job_control ? state->pgid : PGID_INHERIT;
+}
+
+// Puts a process that was just started in the pipeline's group, starting the
+// group with it if it's the first
+static void join_pipeline(vm_state *state, pid_t child) {
+    if (state->job_control && child > 0 && state->pgid == PGID_NEW) {
+        state->pgid = child;
     }
+}
 
-    if (tree->type == PARSE_TREE_AND) {
-        execution_context left_context = context;
-        left_context.wait = true;
-        bool left_status = exec_tree_real(tree->left, left_context);
-        if (left_status) {
-            return exec_tree_real(tree->right, context);
-        }
+// Opens the pipe for an OP_PIPE. Both ends are close-on-exec, so only the
+// processes they are handed to ever hold them.
+static bool open_pipe(vm_state *state) {
+    int pipes[2];
+    if (pipe2(pipes, O_CLOEXEC) == -1) {
+        perror("Error: ");
         return false;
     }
+    if (state->pipe_size > 0) {
+        fcntl(pipes[1], F_SETPIPE_SZ, state->pipe_size);
+    }
+    state->context.outfd = pipes[1];
+    state->next_infd = pipes[0];
+    return true;
+}
+
+// Takes the descriptors for the process about to be started, leaving those for
+// the one after it
+static execution_context take_context(vm_state *state) {
+    execution_context context = state->context;
+    state->context.infd = state->next_infd;
+    state->context.outfd = STDOUT_FILENO;
+    state->next_infd = STDIN_FILENO;
+    return context;
+}
+
+static void add_pending(vm_state *state, pid_t pid) {
+    if (state->pending_count == 0 && tracing()) {
+        state->pipeline_started = trace_clock();
+    }
+    if (state->pending_count >= state->pending_capacity) {
+        state->pending_capacity = state->pending_capacity * 2;
+        state->pending = realloc(state->pending, sizeof(pid_t) * state->pending_capacity);
+        state->statuses = realloc(state->statuses, sizeof(int) * state->pending_capacity);
+    }
+    // Processes that couldn't be started fail unless the caller says otherwise
+    state->statuses[state->pending_count] = 1;
+    state->pending[state->pending_count++] = pid;
+}
 
-    if (tree->type == PARSE_TREE_BACKGROUND) {
-        execution_context background_context = context;
-        background_context.wait = false;
-        subshell_exec_tree_real(tree->left, background_context);
-        if (tree->right) {
-            return exec_tree_real(tree->right, context);
+// A stopped process counts as finished with 128 plus the stopping signal, so
+// the shell never waits on a process that can't go on
+static int wait_status(pid_t pid, bool *stopped) {
+    int status;
+    struct rusage usage;
+    *stopped = false;
+    long long start = stats_clock();
+    if (pid <= 0 || wait4(pid, &status, WUNTRACED, &usage) == -1) {
+        return 1;
+    }
+    record_wait_latency(start);
+    *stopped = WIFSTOPPED(status);
+    if (!*stopped) {
+        trace_reaped(pid, status, &usage);
+    }
+    return exit_status(status);
+}
+
+// Traces a process started to run the code in [start, end)
+static void trace_code(pid_t pid, const char *category, program *program, size_t start,
+                       size_t end) {
+    if (!tracing()) {
+        return;
+    }
+    string_buffer *text = init_string_buffer();
+    describe_code(program, start, end, text);
+    trace_spawned(pid, category, string_buffer_contents(text), NULL);
+    free_string_buffer(text);
+}
+
+// Sets up a forked child, which joins the process group pgid unless it's
+// PGID_INHERIT, taking the terminal if it leads a foreground group. The group
+// is set on both sides of the fork so neither can get ahead of it. The child
+// also drops the read end of a pipe left open for the next stage, so that
+// stage sees the end of its input once the others exit. The jobs stay the
+// shell's to collect.
+static void enter_child(vm_state *state, pid_t pgid, bool foreground) {
+    if (pgid != PGID_INHERIT) {
+        setpgid(0, pgid);
+        if (foreground && state->terminal && pgid == PGID_NEW) {
+            give_terminal(getpid());
         }
-        return true;
     }
+    if (state->context.infd != STDIN_FILENO) {
+        close(state->context.infd);
+    }
+    detach_jobs();
+}
+
+static void place_child(pid_t child, pid_t pgid) {
+    if (child > 0 && pgid != PGID_INHERIT) {
+        setpgid(child, pgid == PGID_NEW ? child : pgid);
+    }
+}
+
+// Builtins in a pipeline run in a child like any other stage, so the shell
+// never blocks writing to a pipe whose reader hasn't been started yet
+static pid_t fork_builtin(vm_state *state, builtin_function *builtin, char **argv,
+                          execution_context context, const placement *placement) {
+    pid_t pgid = next_pgid(state);
+    pid_t child = fork();
+    if (child == 0) {
+        enter_child(state, pgid, true);
+        apply_placement(placement);
+        _exit(builtin(argv, context.infd, context.outfd));
+    }
+    place_child(child, pgid);
+    return child;
+}
+
+// Builtins run in the shell itself unless they are one stage of a pipeline. A
+// lone command in tail position is exec'd in place, saving a process. Stages
+// of a pipeline are placed by the affinity policy.
+static void vm_spawn(vm_state *state, parse_tree *command, bool tail) {
+    // Only a pipe can have set up the context before the command's own redirections
+    bool piped = state->context.infd != STDIN_FILENO || state->context.outfd != STDOUT_FILENO;
+    execution_context context = take_context(state);
+
+    for (size_t i = 0; i < command->redirection_count; i++) {
+        apply_redirection(&context, &command->redirections[i]);
+    }
+
+    builtin_function *builtin = find_builtin(command->argv[0]);
+    if (builtin && !piped) {
+        long long started = tracing() ? trace_clock() : 0;
+        state->status = builtin(command->argv, context.infd, context.outfd);
+        close_context(context);
+        trace_span("builtin", command->argv[0], started, state->status);
+        return;
+    }
+
+    if (tail && !piped && state->pending_count == 0) {
+        exec_in_place(command->argv, &context);
+        state->status = launch_failure(command->argv[0], errno);
+        close_context(context);
+        return;
+    }
+
+    const placement *placement = piped ? next_placement(false) : NULL;
+    pid_t child;
+    if (builtin) {
+        child = fork_builtin(state, builtin, command->argv, context, placement);
+    } else {
+        child = do_exec(command->argv, context, next_pgid(state), state->terminal, placement);
+    }
+    int error = errno;
+    close_context(context);
+    trace_spawned(child, builtin ? "builtin" : "command", NULL, command->argv);
+    join_pipeline(state, child);
+    add_pending(state, child);
+    if (child == -1 && !builtin) {
+        state->statuses[state->pending_count - 1] = launch_failure(command->argv[0], error);
+    }
+}
+
+// Sets up the state of a child forked to run part of the program
+static void become_child(vm_state *state) {
+    state->pending_count = 0;
+    state->job_control = false;
+    state->terminal = false;
+    state->forked = true;
+    state->exits = true;
+    reset_context(state);
+    forked_child = true;
+}
+
+// Forks a child that carries on running the program after this instruction.
+// A subshell in a pipeline joins its group. Background lists lead a group of
+// their own if the shell has the terminal to hand it to later, and otherwise
+// stay in the shell's.
+static pid_t subshell_exec(vm_state *state, pid_t pgid, bool foreground,
+                           const placement *placement) {
+    execution_context context = take_context(state);
+    pid_t child;
+    if ((child = fork()) == 0) {
+        // Child
+        enter_child(state, pgid, foreground);
+        apply_placement(placement);
+        redirect_stdio(&context);
+        forget_jobs();
+        become_child(state);
+        return 0;
+    }
+    place_child(child, pgid);
+    close_context(context);
+    return child;
+}
+
+// Adds a job for the code in [start, end), and returns its number
+static int vm_add_job(program *program, size_t start, size_t end, pid_t pgid,
+                      pid_t *pids, size_t count, bool stopped) {
+    string_buffer *command = init_string_buffer();
+    describe_code(program, start, end, command);
+    int number = add_job(pgid, pids, count, string_buffer_contents(command), stopped);
+    free_string_buffer(command);
+    return number;
+}
 
-    if (tree->type == PARSE_TREE_COMMAND) {
-        char **argv = tree->argv;
-        
-        if (is_builtin(argv)) {
-            return exec_builtin(tree);
+// Waits for every stage of the pipeline, whose status is that of its last,
+// then takes the terminal back from its group. Stages that were stopped are
+// left to the job table. The pipeline's code ends at end.
+static void vm_wait(vm_state *state, program *program, size_t end) {
+    size_t stopped_count = 0;
+    for (size_t i = 0; i < state->pending_count; i++) {
+        bool stopped = false;
+        if (state->pending[i] > 0) {
+            state->statuses[i] = wait_status(state->pending[i], &stopped);
         }
+        state->status = state->statuses[i];
+        if (stopped) {
+            state->pending[stopped_count++] = state->pending[i];
+        }
+    }
+    if (stopped_count > 0 && state->job_control) {
+        vm_add_job(program, state->pipeline_start, end, state->pgid,
+                   state->pending, stopped_count, true);
+    }
+    if (state->pending_count > 1 && tracing()) {
+        string_buffer *text = init_string_buffer();
+        describe_code(program, state->pipeline_start, end, text);
+        trace_span("pipeline", string_buffer_contents(text), state->pipeline_started,
+                   state->status);
+        free_string_buffer(text);
+    }
+    state->pending_count = 0;
+    if (state->terminal && state->pgid != PGID_NEW) {
+        give_terminal(getpgrp());
+    }
+    state->pgid = PGID_NEW;
+    if (state->job_control) {
+        update_jobs();
+    }
+}
 
-        execution_context child_context = context;
-        if (tree->redirections[0]) {
-            apply_redirection(&child_context, tree->redirections[0]);
-            if (tree->redirections[1]) {
-                apply_redirection(&child_context, tree->redirections[0]);
-            }
+// Whether every path from pc reaches OP_EXIT without doing anything else, so
+// the process has nothing left to do whatever the last status was
+static bool reaches_exit(program *program, size_t pc) {
+    while (1) {
+        instruction *inst = &program->code[pc];
+        switch (inst->op) {
+            case OP_EXIT:
+                return true;
+            case OP_JUMP_IF_SUCCESS:
+            case OP_JUMP_IF_FAILURE:
+                if (!reaches_exit(program, inst->target)) {
+                    return false;
+                }
+                pc++;
+                break;
+            default:
+                return false;
         }
+    }
+}
+
+// Whether the process only waits for a command started just before pc and
+// then exits
+static bool is_tail(program *program, size_t pc) {
+    return program->code[pc].op == OP_WAIT && reaches_exit(program, pc + 1);
+}
+
+static int run_program(vm_state *state, program *program, size_t pc);
 
-        return do_exec(argv, child_context) == 0;
+// A background list waiting for a job slot. It runs in the directory the shell
+// was in when it was queued, since the shell may have moved on by then.
+struct queued_list {
+    program *program;
+    size_t pc;
+    char *cwd;
+    int job;
+};
+typedef struct queued_list queued_list;
+
+static pid_t launch_queued_list(void *data, bool own_group) {
+    queued_list *list = data;
+    job_output output;
+    bool muxed = open_job_output(&output);
+    const placement *placement = next_placement(true);
+    pid_t child = fork();
+    if (child == 0) {
+        if (own_group) {
+            setpgid(0, 0);
+        }
+        apply_placement(placement);
+        if (muxed) {
+            redirect_job_output(&output);
+        }
+        forget_jobs();
+        if (list->cwd && chdir(list->cwd) == -1) {
+            perror("Error: ");
+            _exit(1);
+        }
+        vm_state state;
+        init_vm_state(&state, true);
+        become_child(&state);
+        run_program(&state, list->program, list->pc);
     }
+    if (child > 0 && own_group) {
+        setpgid(child, child);
+    }
+    if (muxed) {
+        mux_job_output(&output, list->job);
+    }
+    return child;
+}
 
-    if (tree->type == PARSE_TREE_PIPE) {
-        int pipes[2];
-        pipe(pipes);
+static void release_queued_list(void *data) {
+    queued_list *list = data;
+    free_program(list->program);
+    free(list->cwd);
+    free(list);
+}
 
-        int out_pipe = pipes[1];
-        execution_context left_context = context;
-        left_context.outfd = out_pipe;
-        left_context.wait = false;
+// Starts the background list at pc, whose code ends at end, or queues it if
+// every job slot is taken. Returns false in the forked child, which carries on
+// running the list.
+static bool vm_background(vm_state *state, program *program, size_t pc, size_t end) {
+    bool own_group = state->job_control && state->terminal;
+    // Jobs that finished since the last wait are reaped before the next fork,
+    // so a script that only starts jobs doesn't pile up zombies
+    if (state->job_control) {
+        update_jobs();
+    }
+    if (state->job_control && !job_slot_free()) {
+        queued_list *list = malloc(sizeof(queued_list));
+        list->program = hold_program(program);
+        list->pc = pc;
+        list->cwd = getcwd(NULL, 0);
+        string_buffer *command = init_string_buffer();
+        describe_code(program, pc, end, command);
+        list->job = queue_job(string_buffer_contents(command), own_group, launch_queued_list,
+                              release_queued_list, list);
+        free_string_buffer(command);
+        state->status = 0;
+        return true;
+    }
 
-        int in_pipe = pipes[0];
-        execution_context right_context = context;
-        right_context.infd = in_pipe;
+    job_output output;
+    bool muxed = open_job_output(&output);
+    pid_t job = subshell_exec(state, own_group ? PGID_NEW : PGID_INHERIT, false,
+                              next_placement(true));
+    if (job == 0) {
+        if (muxed) {
+            redirect_job_output(&output);
+        }
+        return false;
+    }
+    int number = 0;
+    if (job > 0 && state->job_control) {
+        number = vm_add_job(program, pc, end, own_group ? job : 0, &job, 1, false);
+    }
+    if (muxed) {
+        mux_job_output(&output, number);
+    }
+    state->status = job > 0 ? 0 : 1;
+    return true;
+}
 
-        exec_tree_real(tree->left, left_context);
-        close(out_pipe);
-        return exec_tree_real(tree->right, right_context);
+// Runs the program from pc until it reaches OP_EXIT
+static int run_program(vm_state *state, program *program, size_t pc) {
+    while (1) {
+        instruction *inst = &program->code[pc++];
+        switch (inst->op) {
+            case OP_SPAWN: ;
+                // Queued jobs are started by the shell, and muxed jobs write
+                // through it, so it can't be replaced. Nor can a process that
+                // is tracing, which would lose the command's span, or one
+                // that writes its stats at exit.
+                bool tail = state->exits && is_tail(program, pc) && !tracing() && !stats_dumping() &&
+                            (state->forked || (!jobs_queued() && !output_mux_running()));
+                vm_spawn(state, inst->command, tail);
+                break;
+            case OP_PIPE:
+                open_pipe(state);
+                break;
+            case OP_WAIT:
+                vm_wait(state, program, pc - 1);
+                state->pipeline_start = pc;
+                break;
+            case OP_JUMP_IF_SUCCESS:
+                if (state->status == 0) {
+                    pc = inst->target;
+                }
+                state->pipeline_start = pc;
+                break;
+            case OP_JUMP_IF_FAILURE:
+                if (state->status != 0) {
+                    pc = inst->target;
+                }
+                state->pipeline_start = pc;
+                break;
+            case OP_BACKGROUND:
+                if (vm_background(state, program, pc, inst->target - 1)) {
+                    pc = inst->target;
+                    state->pipeline_start = pc;
+                }
+                break;
+            case OP_SUBSHELL: ;
+                bool piped = state->context.infd != STDIN_FILENO ||
+                             state->context.outfd != STDOUT_FILENO;
+                pid_t child = subshell_exec(state, next_pgid(state), true,
+                                            piped ? next_placement(false) : NULL);
+                if (child == 0) {
+                    break;
+                }
+                trace_code(child, "subshell", program, pc - 1, inst->target);
+                join_pipeline(state, child);
+                add_pending(state, child);
+                state->status = child > 0 ? 0 : 1;
+                pc = inst->target;
+                break;
+            case OP_ERROR:
+                fprintf(stderr, "Fatal Error: Executing error parse tree\n");
+                state->status = 1;
+                break;
+            case OP_EXIT:
+                if (state->forked) {
+                    exit_shell(state->status);
+                }
+                free_vm_state(state);
+                return state->status;
+        }
     }
+}
 
-    if (tree->type == PARSE_TREE_ERROR) {
-        fprintf(stderr, "Fatal Error: Executing error parse tree\n");
+void exit_shell(int status) {
+    if (forked_child) {
+        flush_trace();
+        fflush(NULL);
+        _exit(status);
     }
+    exit(status);
+}
 
-    return false;
+int exec_program(program *program, bool exits) {
+    vm_state state;
+    init_vm_state(&state, exits);
+    begin_execution();
+    int status = run_program(&state, program, 0);
+    end_execution();
+    return status;
 }
 
-bool exec_tree(parse_tree *tree) {
-    execution_context context;
-    context.outfd = STDOUT_FILENO;
-    context.infd = STDIN_FILENO;
-    context.wait = true;
-    return exec_tree_real(tree, context);
+int exec_tree(parse_tree *tree, bool exits) {
+    program *program = compile_tree(tree);
+    int status = exec_program(program, exits);
+    free_program(program);
+    return status;
 }
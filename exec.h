@@ -1,9 +1,23 @@
 #pragma once
 
+#include <sys/types.h>
+
+#include "affinity.h"
 #include "parser.h"
+#include "program.h"
+
+// Both return the status of the last command run. If exits is set, the shell
+// exits once they are done, so the last command may replace the shell instead.
+int exec_program(program *program, bool exits);
+int exec_tree(parse_tree *tree, bool exits);
 
-bool is_builtin(char **argv);
+// Exits the shell, or a child forked to run part of a program. The shell's exit
+// handlers only run in the shell itself.
+void exit_shell(int status);
 
-bool exec_builtin(parse_tree *tree);
+// Starts argv with the given stdin and stdout, in the shell's process group.
+// Returns -1 if it couldn't be started.
+pid_t spawn_process(char **argv, int infd, int outfd);
 
-bool exec_tree(parse_tree *tree);
+// As spawn_process, started where placement puts it if it's not NULL
+pid_t spawn_placed_process(char **argv, int infd, int outfd, const placement *placement);
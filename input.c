@@ -1,66 +1,176 @@
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <poll.h>
+#include <unistd.h>
+
 #include "input.h"
 #include "tokens.h"
 
 
-#define INPUT_BUFFER_SIZE 1024
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+// How long the watched descriptor is ignored for when it's readable but there
+// was nothing to handle
+#define WATCH_RETRY_MS 100
 
 
 struct input_line {
     char *content;
-    bool more;
+    size_t length;
 };
 
+// Bytes in [start, end) of the buffer have been read but not yet handed out
+struct input_reader {
+    int fd;
+    bool interactive;
+    bool eof;
 
-static input_line *init_input_line(size_t size) {
-    input_line *line = malloc(sizeof(input_line));
-    line->more = false;
-    line->content = malloc(sizeof(char) * size + 1);
-    return line;
+    char *buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+
+    input_line line;
+
+    // Run whenever watch_fd becomes readable while waiting for input
+    int watch_fd;
+    bool (*on_watch)(void);
+    char *prompt;
+};
+
+
+input_reader *init_input_reader(int fd) {
+    input_reader *reader = malloc(sizeof(input_reader));
+    reader->fd = fd;
+    reader->interactive = isatty(fd);
+    reader->eof = false;
+    reader->capacity = INPUT_BUFFER_SIZE;
+    reader->buffer = malloc(sizeof(char) * reader->capacity);
+    reader->start = 0;
+    reader->end = 0;
+    reader->watch_fd = -1;
+    reader->on_watch = NULL;
+    reader->prompt = NULL;
+    return reader;
 }
 
+void free_input_reader(input_reader *reader) {
+    free(reader->buffer);
+    free(reader);
+}
 
-input_line *get_line(FILE *instream, char *prompt) {
-    char in_buffer[INPUT_BUFFER_SIZE];
-    
-    fprintf(stdout, prompt);
-    fflush(stdout);
-    
-    char *i = fgets(in_buffer, INPUT_BUFFER_SIZE, instream);
-    if (i == NULL) {
-        return NULL;
+void watch_while_reading(input_reader *reader, int fd, bool (*on_watch)(void)) {
+    reader->watch_fd = fd;
+    reader->on_watch = on_watch;
+}
+
+static void show_prompt(input_reader *reader) {
+    if (reader->interactive) {
+        fputs(reader->prompt, stdout);
+        fflush(stdout);
     }
-    
-    size_t input_len = strlen(in_buffer);
-    input_line *line = init_input_line(input_len);
-    strncpy(line->content, in_buffer, input_len + 1);
-
-    if (input_len <= 0 || in_buffer[input_len - 1] != CHAR_NEWLINE) {
-        // Something weird happened
-        free_input_line(line);
-        return NULL;
+}
+
+// Blocks until there is input to read, handling the watched descriptor in the
+// meantime. If on_watch finds nothing to do, the descriptor may still be
+// readable, so it's left out of the next poll, which times out after a while
+// to look at it again rather than spinning. Errors are left for read to report.
+static void wait_for_input(input_reader *reader) {
+    struct pollfd fds[2] = {
+        { .fd = reader->fd, .events = POLLIN },
+        { .fd = reader->watch_fd, .events = POLLIN },
+    };
+    while (1) {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        int ready = poll(fds, 2, fds[1].fd == -1 ? WATCH_RETRY_MS : -1);
+        if (ready == -1 && errno != EINTR) {
+            return;
+        }
+        if (ready == 0) {
+            fds[1].fd = reader->watch_fd;
+        }
+        if (fds[1].revents & POLLIN) {
+            if (reader->on_watch()) {
+                show_prompt(reader);
+            } else {
+                fds[1].fd = -1;
+            }
+        }
+        if (fds[0].revents) {
+            return;
+        }
     }
-    if (input_len >= 2 && (in_buffer[input_len - 2] == CHAR_ESCAPE)) {
-        line->more = true;
-    } else {
-        line->more = false;
+}
+
+// Reads more input after what's buffered, first moving the unread bytes to the
+// front of the buffer, or growing it if a single line already fills it
+static bool fill_buffer(input_reader *reader) {
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end = reader->end - reader->start;
+        reader->start = 0;
     }
-    return line;
+    if (reader->end == reader->capacity) {
+        reader->capacity = reader->capacity * 2;
+        reader->buffer = realloc(reader->buffer, sizeof(char) * reader->capacity);
+    }
+
+    if (reader->watch_fd != -1) {
+        wait_for_input(reader);
+    }
+
+    ssize_t count;
+    do {
+        count = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end);
+    } while (count == -1 && errno == EINTR);
+    if (count <= 0) {
+        reader->eof = true;
+        return false;
+    }
+    reader->end += count;
+    return true;
 }
 
-void free_input_line(input_line *line) {
-    free(line->content);
-    free(line);
+input_line *get_line(input_reader *reader, char *prompt) {
+    reader->prompt = prompt;
+    show_prompt(reader);
+
+    // Only the bytes read since the last search need to be searched again
+    size_t searched = reader->start;
+    char *newline = NULL;
+    while (1) {
+        newline = memchr(reader->buffer + searched, CHAR_NEWLINE, reader->end - searched);
+        if (newline || reader->eof) {
+            break;
+        }
+        size_t offset = searched - reader->start;
+        if (!fill_buffer(reader)) {
+            break;
+        }
+        searched = reader->start + offset;
+    }
+
+    size_t line_end = newline ? (size_t) (newline - reader->buffer) + 1 : reader->end;
+    if (line_end == reader->start) {
+        return NULL;
+    }
+
+    input_line *line = &reader->line;
+    line->content = reader->buffer + reader->start;
+    line->length = line_end - reader->start;
+    reader->start = line_end;
+    return line;
 }
 
 char *line_content(input_line *line) {
     return line->content;
 }
 
-bool line_hasmore(input_line *line) {
-    return line->more;
+size_t line_length(input_line *line) {
+    return line->length;
 }
@@ -1,14 +1,29 @@
 #pragma once
 
-#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 
+// Reads lines from a descriptor through one large buffer that is reused for
+// every line, so lines can be any length and are never copied out of it
+struct input_reader;
+typedef struct input_reader input_reader;
+
+// A view of a line in the reader's buffer, including its newline, that stays
+// valid until the next line is read
 struct input_line;
 typedef struct input_line input_line;
 
 
-input_line *get_line(FILE *instream, char *prompt);
-void free_input_line(input_line *line);
+input_reader *init_input_reader(int fd);
+void free_input_reader(input_reader *reader);
+
+// While waiting for input, on_watch is run whenever fd becomes readable. If it
+// returns true, it has written something and the prompt is shown again.
+void watch_while_reading(input_reader *reader, int fd, bool (*on_watch)(void));
+
+// The prompt is only shown when reading from a terminal
+input_line *get_line(input_reader *reader, char *prompt);
 
 char *line_content(input_line *line);
-bool line_hasmore(input_line *line);
+size_t line_length(input_line *line);
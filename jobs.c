@@ -0,0 +1,791 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <termios.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "trace.h"
+
+
+// Most background jobs to run at once, where unset or 0 is no limit
+#define JOBS_ENV "NUSH_JOBS"
+
+#define JOB_INITIAL_SLOTS 8
+
+// Events taken from the epoll instance at a time
+#define JOB_EVENT_BATCH 16
+
+// How often processes without a pidfd are polled while waiting for a job slot
+#define JOB_POLL_MILLISECONDS 10
+
+#define REAPED_INITIAL_SLOTS 64
+
+
+enum job_state {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+};
+typedef enum job_state job_state;
+
+struct job_process {
+    pid_t pid;
+    int pidfd; // -1 once reaped, or if it couldn't be opened
+    bool stopped;
+    bool done;
+    int status;
+    job *job;
+};
+typedef struct job_process job_process;
+
+struct job {
+    int number;
+    pid_t pgid;
+
+    // In pipeline order, so the last one's status is the job's
+    job_process *processes;
+    size_t count;
+    size_t remaining;
+
+    char *command;
+
+    // When it last became the current job, which is the one with the highest
+    unsigned long sequence;
+
+    struct timespec started;
+    struct timespec finished;
+    struct rusage usage; // Of the processes reaped so far
+
+    // Background jobs take a job slot until they finish
+    bool holds_slot;
+
+    // Queued jobs have no processes until launch starts one
+    bool queued;
+    bool own_group;
+    job_launcher *launch;
+    void (*release)(void *data);
+    void *data;
+    struct job *next_queued;
+
+    struct job *next_finished;
+};
+
+// What wait needs of a process whose job was dropped when it finished
+struct reaped_process {
+    pid_t pid; // 0 for an empty slot
+    int status;
+};
+typedef struct reaped_process reaped_process;
+
+// Job number n is in slots[n - 1]. New jobs take the number after the highest
+// one in use, so numbers are reused once the jobs above them are gone.
+struct job_table {
+    job **slots;
+    size_t capacity;
+    size_t count;
+
+    int epoll; // -1 until there is a job to watch
+    bool interactive;
+    unsigned long sequence;
+
+    // Jobs that have finished but are still in the table
+    job *finished;
+
+    // Processes without a pidfd, which can only be polled
+    size_t polled;
+
+    // When the shell isn't interactive, finished jobs are dropped as soon as
+    // they are reaped, and their processes' statuses are kept here by pid. A
+    // pid that's reused replaces the old one, so it never outgrows pid_max.
+    reaped_process *reaped;
+    size_t reaped_capacity;
+    size_t reaped_count;
+
+    // The job wait_job is waiting for, which mustn't be dropped under it
+    job *waiting;
+
+    // Jobs waiting for a slot, oldest first
+    job *queue_head;
+    job *queue_tail;
+    size_t running;
+    size_t limit;
+    bool limit_known;
+
+    // Set in the shell's forked children, which can't reap its jobs
+    bool detached;
+};
+typedef struct job_table job_table;
+
+static job_table table = {.epoll = -1};
+
+static void start_queued_job(job *job);
+
+
+// The shell's status for a process that exited, was killed or stopped
+int exit_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 1;
+}
+
+// SIGTTOU is blocked, since the shell is itself in the background when it
+// takes the terminal back
+void give_terminal(pid_t pgid) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+static bool have_terminal(void) {
+    return isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+}
+
+int jobs_event_fd(void) {
+    if (table.epoll == -1) {
+        table.epoll = epoll_create1(EPOLL_CLOEXEC);
+    }
+    return table.epoll;
+}
+
+void set_jobs_interactive(bool interactive) {
+    table.interactive = interactive;
+}
+
+static bool finished(job *job) {
+    return !job->queued && job->remaining == 0;
+}
+
+static job_state state_of(job *job) {
+    if (job->queued) {
+        return JOB_QUEUED;
+    }
+    if (job->remaining == 0) {
+        return JOB_DONE;
+    }
+    for (size_t i = 0; i < job->count; i++) {
+        if (!job->processes[i].done && job->processes[i].stopped) {
+            return JOB_STOPPED;
+        }
+    }
+    return JOB_RUNNING;
+}
+
+static job *current_job(void) {
+    job *current = NULL;
+    for (size_t i = 0; i < table.count; i++) {
+        job *job = table.slots[i];
+        if (job && (!current || job->sequence > current->sequence)) {
+            current = job;
+        }
+    }
+    return current;
+}
+
+static void print_job(int fd, job *job, bool verbose) {
+    char state[32];
+    switch (state_of(job)) {
+        case JOB_QUEUED:
+            strcpy(state, "Queued");
+            break;
+        case JOB_RUNNING:
+            strcpy(state, "Running");
+            break;
+        case JOB_STOPPED:
+            strcpy(state, "Stopped");
+            break;
+        case JOB_DONE: ;
+            int status = job->processes[job->count - 1].status;
+            if (status == 0) {
+                strcpy(state, "Done");
+            } else {
+                snprintf(state, sizeof(state), "Exit %d", status);
+            }
+            break;
+    }
+    char marker = job == current_job() ? '+' : ' ';
+    if (!verbose) {
+        dprintf(fd, "[%d]%c  %-24s%s\n", job->number, marker, state, job->command);
+        return;
+    }
+
+    struct timespec end = job->finished;
+    if (!finished(job)) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+    double elapsed = (end.tv_sec - job->started.tv_sec) +
+                     (end.tv_nsec - job->started.tv_nsec) / 1e9;
+    double user = job->usage.ru_utime.tv_sec + job->usage.ru_utime.tv_usec / 1e6;
+    double system = job->usage.ru_stime.tv_sec + job->usage.ru_stime.tv_usec / 1e6;
+    dprintf(fd, "[%d]%c %-8d %-12s %8.2fs real %7.2fs user %7.2fs sys %8ldK rss  %s\n",
+            job->number, marker, job->count > 0 ? job->processes[0].pid : 0, state, elapsed, user, system,
+            job->usage.ru_maxrss, job->command);
+}
+
+static void add_usage(struct rusage *total, struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+}
+
+// Takes a number for a new job, with no processes yet
+static job *new_job(const char *command) {
+    if (table.count == table.capacity) {
+        table.capacity = table.capacity ? table.capacity * 2 : JOB_INITIAL_SLOTS;
+        table.slots = realloc(table.slots, sizeof(job *) * table.capacity);
+    }
+    job *job = malloc(sizeof(struct job));
+    job->number = table.count + 1;
+    job->pgid = 0;
+    job->processes = NULL;
+    job->count = 0;
+    job->remaining = 0;
+    job->command = strdup(command);
+    job->sequence = ++table.sequence;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    memset(&job->usage, 0, sizeof(job->usage));
+    job->holds_slot = false;
+    job->queued = false;
+    job->next_queued = NULL;
+    job->next_finished = NULL;
+    table.slots[table.count++] = job;
+    return job;
+}
+
+static void watch_processes(job *job, pid_t *pids, size_t count, bool stopped) {
+    int epoll = jobs_event_fd();
+    job->processes = malloc(sizeof(job_process) * count);
+    job->count = count;
+    job->remaining = count;
+    for (size_t i = 0; i < count; i++) {
+        job_process *process = &job->processes[i];
+        process->pid = pids[i];
+        process->stopped = stopped;
+        process->done = false;
+        process->status = 0;
+        process->job = job;
+        process->pidfd = pidfd_open(pids[i], 0);
+        if (!stopped) {
+            trace_spawned(pids[i], "job", job->command, NULL);
+        }
+        if (process->pidfd != -1) {
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = process};
+            epoll_ctl(epoll, EPOLL_CTL_ADD, process->pidfd, &event);
+        } else {
+            table.polled++;
+        }
+    }
+    if (!stopped) {
+        job->holds_slot = true;
+        table.running++;
+    }
+}
+
+int add_job(pid_t pgid, pid_t *pids, size_t count, const char *command, bool stopped) {
+    job *job = new_job(command);
+    job->pgid = pgid;
+    watch_processes(job, pids, count, stopped);
+
+    if (stopped) {
+        dprintf(STDERR_FILENO, "\n");
+        print_job(STDERR_FILENO, job, false);
+    } else if (table.interactive) {
+        dprintf(STDERR_FILENO, "[%d] %d\n", job->number, pids[count - 1]);
+    }
+    return job->number;
+}
+
+static size_t job_limit(void) {
+    if (!table.limit_known) {
+        char *limit = getenv(JOBS_ENV);
+        table.limit = limit ? strtoul(limit, NULL, 10) : 0;
+        table.limit_known = true;
+    }
+    return table.limit;
+}
+
+// Starts queued jobs, oldest first, while there are slots for them
+static void fill_job_slots(void) {
+    while (!table.detached && table.queue_head &&
+           (job_limit() == 0 || table.running < job_limit())) {
+        start_queued_job(table.queue_head);
+    }
+}
+
+void set_job_limit(size_t limit) {
+    table.limit = limit;
+    table.limit_known = true;
+    fill_job_slots();
+}
+
+bool job_slot_free(void) {
+    if (job_limit() > 0 && table.running >= job_limit()) {
+        update_jobs();
+    }
+    return !table.queue_head && (job_limit() == 0 || table.running < job_limit());
+}
+
+bool jobs_queued(void) {
+    return table.queue_head != NULL;
+}
+
+int queue_job(const char *command, bool own_group, job_launcher *launch,
+              void (*release)(void *data), void *data) {
+    job *job = new_job(command);
+    job->queued = true;
+    job->own_group = own_group;
+    job->launch = launch;
+    job->release = release;
+    job->data = data;
+    if (table.queue_tail) {
+        table.queue_tail->next_queued = job;
+    } else {
+        table.queue_head = job;
+    }
+    table.queue_tail = job;
+    if (table.interactive) {
+        dprintf(STDERR_FILENO, "[%d] queued\n", job->number);
+    }
+    return job->number;
+}
+
+static void unqueue_job(job *job) {
+    struct job **link = &table.queue_head;
+    struct job *previous = NULL;
+    while (*link != job) {
+        previous = *link;
+        link = &(*link)->next_queued;
+    }
+    *link = job->next_queued;
+    if (table.queue_tail == job) {
+        table.queue_tail = previous;
+    }
+    job->next_queued = NULL;
+    job->queued = false;
+}
+
+// Starts a queued job now, whether or not there's a slot for it. A job that
+// can't be started finishes at once with status 1.
+static void start_queued_job(job *job) {
+    unqueue_job(job);
+    pid_t pid = job->launch(job->data, job->own_group);
+    job->release(job->data);
+    if (pid == -1) {
+        pid_t none = -1;
+        watch_processes(job, &none, 1, false);
+        job->processes[0].done = true;
+        job->processes[0].status = 1;
+        job->remaining = 0;
+        table.polled--;
+        table.running--;
+        clock_gettime(CLOCK_MONOTONIC, &job->finished);
+        job->next_finished = table.finished;
+        table.finished = job;
+        return;
+    }
+    job->pgid = job->own_group ? pid : 0;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    watch_processes(job, &pid, 1, false);
+}
+
+// Children forked before they exec share the pidfd, which would stay in the
+// epoll instance after it's closed here, so it's taken out first
+static void unwatch_process(job_process *process) {
+    epoll_ctl(table.epoll, EPOLL_CTL_DEL, process->pidfd, NULL);
+    close(process->pidfd);
+    process->pidfd = -1;
+}
+
+static void drop_job(job *job) {
+    if (job->queued) {
+        unqueue_job(job);
+        job->release(job->data);
+    }
+    for (size_t i = 0; i < job->count; i++) {
+        if (job->processes[i].pidfd != -1) {
+            unwatch_process(&job->processes[i]);
+        } else if (!job->processes[i].done) {
+            table.polled--;
+        }
+    }
+    if (finished(job)) {
+        struct job **link = &table.finished;
+        while (*link && *link != job) {
+            link = &(*link)->next_finished;
+        }
+        if (*link) {
+            *link = job->next_finished;
+        }
+    }
+    table.slots[job->number - 1] = NULL;
+    while (table.count > 0 && !table.slots[table.count - 1]) {
+        table.count--;
+    }
+    free(job->processes);
+    free(job->command);
+    free(job);
+}
+
+// Collects whatever wait4 reports for the process with the given options.
+// Returns false if there was nothing to collect.
+static bool reap_process(job_process *process, int options) {
+    if (table.detached) {
+        return false;
+    }
+    int status;
+    struct rusage usage;
+    pid_t result;
+    do {
+        result = wait4(process->pid, &status, options, &usage);
+    } while (result == -1 && errno == EINTR);
+    if (result == 0) {
+        return false;
+    }
+
+    job *job = process->job;
+    if (result != -1 && WIFSTOPPED(status)) {
+        process->stopped = true;
+        process->status = exit_status(status);
+        job->sequence = ++table.sequence;
+        return true;
+    }
+    if (result != -1 && WIFCONTINUED(status)) {
+        process->stopped = false;
+        return true;
+    }
+
+    // Gone, or never the shell's child to begin with
+    process->stopped = false;
+    process->done = true;
+    process->status = result == -1 ? 127 : exit_status(status);
+    if (result != -1) {
+        add_usage(&job->usage, &usage);
+        trace_reaped(process->pid, status, &usage);
+    }
+    if (process->pidfd != -1) {
+        unwatch_process(process);
+    } else {
+        table.polled--;
+    }
+    if (--job->remaining == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &job->finished);
+        job->next_finished = table.finished;
+        table.finished = job;
+        if (job->holds_slot) {
+            table.running--;
+            fill_job_slots();
+        }
+    }
+    return true;
+}
+
+static size_t reaped_slot(reaped_process *reaped, size_t capacity, pid_t pid) {
+    size_t slot = ((size_t) pid * 0x9e3779b97f4a7c15) & (capacity - 1);
+    while (reaped[slot].pid != 0 && reaped[slot].pid != pid) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+static void keep_reaped(job_process *process) {
+    if (process->pid <= 0) {
+        return;
+    }
+    if ((table.reaped_count + 1) * 2 > table.reaped_capacity) {
+        size_t capacity = table.reaped_capacity ? table.reaped_capacity * 2 : REAPED_INITIAL_SLOTS;
+        reaped_process *reaped = calloc(capacity, sizeof(reaped_process));
+        for (size_t i = 0; i < table.reaped_capacity; i++) {
+            if (table.reaped[i].pid != 0) {
+                reaped[reaped_slot(reaped, capacity, table.reaped[i].pid)] = table.reaped[i];
+            }
+        }
+        free(table.reaped);
+        table.reaped = reaped;
+        table.reaped_capacity = capacity;
+    }
+    size_t slot = reaped_slot(table.reaped, table.reaped_capacity, process->pid);
+    if (table.reaped[slot].pid == 0) {
+        table.reaped_count++;
+    }
+    table.reaped[slot].pid = process->pid;
+    table.reaped[slot].status = process->status;
+}
+
+bool find_reaped(const char *spec, int *status) {
+    char *end;
+    long pid = strtol(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0' || pid <= 0 || table.reaped_capacity == 0) {
+        return false;
+    }
+    size_t slot = reaped_slot(table.reaped, table.reaped_capacity, pid);
+    if (table.reaped[slot].pid == 0) {
+        return false;
+    }
+    *status = table.reaped[slot].status;
+    return true;
+}
+
+// Blocks until some job's process exits, and reaps it
+static void wait_for_job_event(void) {
+    struct epoll_event event;
+    epoll_wait(jobs_event_fd(), &event, 1, table.polled > 0 ? JOB_POLL_MILLISECONDS : -1);
+    update_jobs();
+}
+
+void drain_job_queue(void) {
+    while (table.queue_head) {
+        fill_job_slots();
+        if (table.queue_head) {
+            wait_for_job_event();
+        }
+    }
+}
+
+bool update_jobs(void) {
+    if (table.detached) {
+        return false;
+    }
+    if (table.epoll != -1) {
+        struct epoll_event events[JOB_EVENT_BATCH];
+        int ready;
+        do {
+            ready = epoll_wait(table.epoll, events, JOB_EVENT_BATCH, 0);
+            for (int i = 0; i < ready; i++) {
+                reap_process(events[i].data.ptr, WNOHANG);
+            }
+        } while (ready == JOB_EVENT_BATCH);
+    }
+
+    for (size_t i = 0; table.polled > 0 && i < table.count; i++) {
+        job *job = table.slots[i];
+        for (size_t j = 0; job && j < job->count; j++) {
+            if (!job->processes[j].done && job->processes[j].pidfd == -1) {
+                reap_process(&job->processes[j], WNOHANG);
+            }
+        }
+    }
+
+    // Nothing reports finished jobs in a script, so they go at once
+    job **link = &table.finished;
+    while (!table.interactive && *link) {
+        job *job = *link;
+        if (job == table.waiting) {
+            link = &job->next_finished;
+            continue;
+        }
+        for (size_t i = 0; i < job->count; i++) {
+            keep_reaped(&job->processes[i]);
+        }
+        drop_job(job);
+    }
+    return table.finished != NULL;
+}
+
+// Stops and continues don't wake the epoll instance, so they are only noticed
+// when asked for
+static void poll_jobs(void) {
+    update_jobs();
+    for (size_t i = 0; i < table.count; i++) {
+        job *job = table.slots[i];
+        for (size_t j = 0; job && j < job->count; j++) {
+            if (!job->processes[j].done) {
+                reap_process(&job->processes[j], WNOHANG | WUNTRACED | WCONTINUED);
+            }
+        }
+    }
+}
+
+void report_finished_jobs(int fd) {
+    for (size_t i = 0; i < table.count; i++) {
+        job *job = table.slots[i];
+        if (job && finished(job)) {
+            print_job(fd, job, false);
+            drop_job(job);
+        }
+    }
+}
+
+void print_jobs(int fd, bool verbose) {
+    poll_jobs();
+    for (size_t i = 0; i < table.count; i++) {
+        job *job = table.slots[i];
+        if (job) {
+            print_job(fd, job, verbose);
+        }
+    }
+    for (size_t i = 0; i < table.count; i++) {
+        job *job = table.slots[i];
+        if (job && finished(job)) {
+            drop_job(job);
+        }
+    }
+}
+
+job *find_job(const char *spec, bool pids) {
+    if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        return current_job();
+    }
+    bool number = spec[0] == '%' || !pids;
+    if (spec[0] == '%') {
+        spec++;
+    }
+    char *end;
+    long value = strtol(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0' || value <= 0) {
+        return NULL;
+    }
+    if (number) {
+        return (size_t) value <= table.count ? table.slots[value - 1] : NULL;
+    }
+    for (size_t i = 0; i < table.count; i++) {
+        job *job = table.slots[i];
+        for (size_t j = 0; job && j < job->count; j++) {
+            if (job->processes[j].pid == value) {
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+int wait_job(job *job) {
+    table.waiting = job;
+    while (job->queued) {
+        fill_job_slots();
+        if (job->queued) {
+            wait_for_job_event();
+        }
+    }
+    table.waiting = NULL;
+    for (size_t i = 0; i < job->count; i++) {
+        while (!job->processes[i].done) {
+            reap_process(&job->processes[i], 0);
+        }
+    }
+    int status = job->processes[job->count - 1].status;
+    drop_job(job);
+    return status;
+}
+
+void wait_all_jobs(void) {
+    poll_jobs();
+    for (size_t i = 0; i < table.count; i++) {
+        job *job = table.slots[i];
+        if (job && state_of(job) != JOB_STOPPED) {
+            wait_job(job);
+        }
+    }
+}
+
+static void continue_job(job *job) {
+    for (size_t i = 0; i < job->count; i++) {
+        job_process *process = &job->processes[i];
+        if (!process->done) {
+            process->stopped = false;
+            if (job->pgid == 0) {
+                kill(process->pid, SIGCONT);
+            }
+        }
+    }
+    if (job->pgid != 0) {
+        kill(-job->pgid, SIGCONT);
+    }
+}
+
+// Gives the job the terminal if it has a group of its own, and waits for it to
+// finish or stop again
+int foreground_job(job *job, int fd) {
+    dprintf(fd, "%s\n", job->command);
+    if (job->queued) {
+        start_queued_job(job);
+    }
+    bool terminal = job->pgid != 0 && have_terminal();
+    if (terminal) {
+        give_terminal(job->pgid);
+    }
+    continue_job(job);
+
+    int status = 0;
+    for (size_t i = 0; i < job->count; i++) {
+        job_process *process = &job->processes[i];
+        while (!process->done && !process->stopped) {
+            reap_process(process, WUNTRACED);
+        }
+        status = process->status;
+    }
+    if (terminal) {
+        give_terminal(getpgrp());
+    }
+
+    if (state_of(job) == JOB_STOPPED) {
+        job->sequence = ++table.sequence;
+        dprintf(STDERR_FILENO, "\n");
+        print_job(STDERR_FILENO, job, false);
+    } else {
+        drop_job(job);
+    }
+    return status;
+}
+
+int background_job(job *job, int fd) {
+    if (job->queued) {
+        dprintf(fd, "[%d] %s is queued\n", job->number, job->command);
+        return 0;
+    }
+    dprintf(fd, "[%d] %s &\n", job->number, job->command);
+    continue_job(job);
+    return 0;
+}
+
+// The table is abandoned rather than taken apart, so a child forked while many
+// jobs are out doesn't pay for each of them. Queued jobs aren't released, as
+// what they hold is the shell's, and the pidfds close when the child execs.
+void forget_jobs(void) {
+    if (table.epoll != -1) {
+        close(table.epoll);
+        table.epoll = -1;
+    }
+    table.slots = NULL;
+    table.capacity = 0;
+    table.count = 0;
+    table.finished = NULL;
+    table.polled = 0;
+    table.reaped = NULL;
+    table.reaped_capacity = 0;
+    table.reaped_count = 0;
+    table.queue_head = NULL;
+    table.queue_tail = NULL;
+    table.running = 0;
+    table.interactive = false;
+    table.detached = false;
+}
+
+void detach_jobs(void) {
+    table.detached = true;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+
+// Jobs are commands left running in the background, and foreground pipelines
+// that were stopped. Every process of a job is watched through a pidfd, all of
+// them registered with one epoll instance, so the shell notices when they exit
+// without waiting on them and reaps them as it goes. Each job keeps its status,
+// when it started and the resources its processes used.
+
+struct job;
+typedef struct job job;
+
+// Starts the process of a queued job, in a process group of its own if
+// own_group is set. Returns -1 if it couldn't be started.
+typedef pid_t job_launcher(void *data, bool own_group);
+
+
+// Adds a job made of the given processes, which lead or have joined the process
+// group pgid, or stay in the shell's if it's 0. Returns the job's number.
+int add_job(pid_t pgid, pid_t *pids, size_t count, const char *command, bool stopped);
+
+// Background jobs can be limited to a number of job slots, from $NUSH_JOBS or
+// set -j. Jobs started while every slot is taken are queued, and started in
+// the order they were queued as slots come free. release is called with data
+// once the job has been started, or is dropped.
+int queue_job(const char *command, bool own_group, job_launcher *launch,
+              void (*release)(void *data), void *data);
+
+// Whether a background job can start now. Jobs never jump the queue.
+bool job_slot_free(void);
+bool jobs_queued(void);
+
+// 0 lifts the limit
+void set_job_limit(size_t limit);
+
+// Starts every queued job, waiting for slots as needed, so none are lost when
+// the shell exits
+void drain_job_queue(void);
+
+// Job numbers and stopped jobs are announced, as a terminal user expects
+void set_jobs_interactive(bool interactive);
+
+// Reaps any processes that have exited without blocking. Returns true if some
+// job has finished and hasn't been reported yet.
+bool update_jobs(void);
+
+// Readable whenever update_jobs has a process to reap
+int jobs_event_fd(void);
+
+// Writes a line for every finished job and forgets them
+void report_finished_jobs(int fd);
+
+// Lists every job, with process ids, times and resource use if verbose, then
+// forgets the finished ones
+void print_jobs(int fd, bool verbose);
+
+// Finds a job by %number, %% or %+ for the current job, or by the process id
+// of one of its processes. A NULL spec is the current job. Bare numbers are
+// job numbers unless pids is set.
+job *find_job(const char *spec, bool pids);
+
+// Unless the shell is interactive, jobs are dropped as soon as they finish,
+// and wait finds the statuses of their processes by pid here. Returns false if
+// spec isn't the pid of one of them.
+bool find_reaped(const char *spec, int *status);
+
+// Each returns the job's status, as the status of its last process
+int wait_job(job *job);
+int foreground_job(job *job, int fd);
+int background_job(job *job, int fd);
+
+// Waits for every running job
+void wait_all_jobs(void);
+
+// Drops the table without touching the jobs, for a child of the shell that
+// can't wait for them
+void forget_jobs(void);
+
+// For a child of the shell that keeps the table to list, but mustn't reap or
+// start any jobs
+void detach_jobs(void);
+
+// Makes a process group the terminal's foreground group
+void give_terminal(pid_t pgid);
+
+// The shell's status for a wait status: the exit code, or 128 plus the signal
+// that killed or stopped the process
+int exit_status(int status);
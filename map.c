@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/pidfd.h>
+#include <sys/wait.h>
+
+#include "exec.h"
+#include "input.h"
+#include "jobs.h"
+#include "map.h"
+#include "util.h"
+
+
+#define PLACEHOLDER "{}"
+
+// Room left in ARG_MAX for what the kernel adds to the argument strings
+#define ARG_HEADROOM 4096
+
+
+struct map_options {
+    size_t workers;
+    size_t batch;     // Most items per command, or 0 for as many as fit
+    bool keep_order;
+    char *file;
+    char **template;
+};
+typedef struct map_options map_options;
+
+// One command started for a batch of items. Commands whose output is kept in
+// order write it to a file of their own, which is copied out once every
+// command before them has been.
+struct invocation {
+    pid_t pid;
+    int pidfd;
+    int output;
+    bool done;
+};
+typedef struct invocation invocation;
+
+// Started commands in input order, from first
+struct invocations {
+    invocation *list;
+    size_t first;
+    size_t count;
+    size_t capacity;
+    size_t running;
+};
+typedef struct invocations invocations;
+
+
+static void usage(void) {
+    fprintf(stderr, "Usage: parallel [-j WORKERS] [-n ITEMS] [-k] [-a FILE] COMMAND [ARG]...\n");
+}
+
+static bool parse_count(const char *str, size_t *count) {
+    char *end;
+    unsigned long value = strtoul(str, &end, 10);
+    if (*str == '\0' || *end != '\0') {
+        return false;
+    }
+    *count = value;
+    return true;
+}
+
+static bool parse_options(char **argv, map_options *options) {
+    options->workers = sysconf(_SC_NPROCESSORS_ONLN);
+    options->batch = 1;
+    options->keep_order = false;
+    options->file = NULL;
+
+    size_t i = 1;
+    for (; argv[i] && argv[i][0] == '-'; i++) {
+        char *option = argv[i];
+        if (strcmp(option, "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(option, "-k") == 0) {
+            options->keep_order = true;
+        } else if (strcmp(option, "-j") == 0 && argv[i + 1]) {
+            if (!parse_count(argv[++i], &options->workers)) {
+                return false;
+            }
+        } else if (strcmp(option, "-n") == 0 && argv[i + 1]) {
+            if (!parse_count(argv[++i], &options->batch)) {
+                return false;
+            }
+        } else if (strcmp(option, "-a") == 0 && argv[i + 1]) {
+            options->file = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    if (options->workers == 0) {
+        options->workers = 1;
+    }
+    options->template = &argv[i];
+    return argv[i] != NULL;
+}
+
+// Bytes an argument takes up in ARG_MAX
+static size_t argument_size(const char *arg) {
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+// What's left of ARG_MAX once the environment is passed
+static size_t argument_budget(void) {
+    long limit = sysconf(_SC_ARG_MAX);
+    size_t used = ARG_HEADROOM;
+    for (char **env = environ; *env; env++) {
+        used += argument_size(*env);
+    }
+    return limit > 0 && (size_t) limit > used ? (size_t) limit - used : 0;
+}
+
+// Replaces every {} in word with item
+static char *substitute(const char *word, const char *item) {
+    string_buffer *buffer = init_string_buffer();
+    const char *placeholder;
+    while ((placeholder = strstr(word, PLACEHOLDER))) {
+        push_string(buffer, word, placeholder - word);
+        push_string(buffer, item, strlen(item));
+        word = placeholder + strlen(PLACEHOLDER);
+    }
+    push_string(buffer, word, strlen(word));
+    char *result = strdup(string_buffer_contents(buffer));
+    free_string_buffer(buffer);
+    return result;
+}
+
+// Builds the argv for a batch. An argument that is just {} is replaced by all
+// of the items, and one that contains {} has it replaced by the only item.
+// Without either, the items follow the template.
+static char **build_argv(char **template, char **items, size_t item_count) {
+    size_t template_count = 0;
+    while (template[template_count]) {
+        template_count++;
+    }
+    char **argv = malloc(sizeof(char *) * (template_count + item_count + 1));
+    size_t argc = 0;
+    bool placed = false;
+    for (size_t i = 0; i < template_count; i++) {
+        if (strcmp(template[i], PLACEHOLDER) == 0) {
+            for (size_t j = 0; j < item_count; j++) {
+                argv[argc++] = strdup(items[j]);
+            }
+            placed = true;
+        } else if (strstr(template[i], PLACEHOLDER)) {
+            argv[argc++] = substitute(template[i], items[0]);
+            placed = true;
+        } else {
+            argv[argc++] = strdup(template[i]);
+        }
+    }
+    for (size_t j = 0; !placed && j < item_count; j++) {
+        argv[argc++] = strdup(items[j]);
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+static void free_argv(char **argv) {
+    for (size_t i = 0; argv[i]; i++) {
+        free(argv[i]);
+    }
+    free(argv);
+}
+
+// Whether the template takes a single item at a time
+static bool takes_one_item(char **template) {
+    for (size_t i = 0; template[i]; i++) {
+        if (strstr(template[i], PLACEHOLDER) && strcmp(template[i], PLACEHOLDER) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the next batch of items into items, which has room for limit. An item
+// that didn't fit is left in held for the next batch. Returns the number read.
+static size_t read_batch(input_reader *reader, char **items, size_t limit, size_t budget,
+                         char **held) {
+    size_t count = 0;
+    size_t size = 0;
+    while (count < limit) {
+        char *item = *held;
+        *held = NULL;
+        if (!item) {
+            input_line *line = get_line(reader, "");
+            if (!line) {
+                break;
+            }
+            size_t length = line_length(line);
+            if (length > 0 && line_content(line)[length - 1] == '\n') {
+                length--;
+            }
+            if (length == 0) {
+                continue;
+            }
+            item = strndup(line_content(line), length);
+        }
+        // A batch always takes its first item, so one too large still runs
+        size += argument_size(item);
+        if (count > 0 && size > budget) {
+            *held = item;
+            break;
+        }
+        items[count++] = item;
+    }
+    return count;
+}
+
+static invocation *add_invocation(invocations *started) {
+    if (started->first > 0 && started->first == started->count) {
+        started->first = 0;
+        started->count = 0;
+    }
+    if (started->count == started->capacity) {
+        if (started->first > 0) {
+            memmove(started->list, started->list + started->first,
+                    sizeof(invocation) * (started->count - started->first));
+            started->count -= started->first;
+            started->first = 0;
+        } else {
+            started->capacity = started->capacity * 2;
+            started->list = realloc(started->list, sizeof(invocation) * started->capacity);
+        }
+    }
+    return &started->list[started->count++];
+}
+
+// Copies out the output of every finished command that isn't waiting on an
+// earlier one
+static void flush_in_order(invocations *started, int out) {
+    while (started->first < started->count && started->list[started->first].done) {
+        invocation *next = &started->list[started->first++];
+        if (next->output != -1) {
+            copy_file_contents(next->output, out);
+            close(next->output);
+        }
+    }
+}
+
+static int finish_invocation(invocation *finished, int status) {
+    finished->done = true;
+    if (finished->pidfd != -1) {
+        close(finished->pidfd);
+    }
+    return status;
+}
+
+// Waits for any running command to finish, and returns its status
+static int wait_any(invocations *started) {
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * started->running);
+    invocation **watched = malloc(sizeof(invocation *) * started->running);
+    size_t count = 0;
+    invocation *unwatched = NULL;
+    for (size_t i = started->first; i < started->count; i++) {
+        invocation *invocation = &started->list[i];
+        if (invocation->done) {
+            continue;
+        }
+        if (invocation->pidfd == -1) {
+            unwatched = unwatched ? unwatched : invocation;
+            continue;
+        }
+        fds[count].fd = invocation->pidfd;
+        fds[count].events = POLLIN;
+        watched[count++] = invocation;
+    }
+
+    // Without pidfds to poll, block on the oldest command instead
+    invocation *finished = unwatched;
+    while (!finished) {
+        if (poll(fds, count, -1) == -1 && errno != EINTR) {
+            finished = watched[0];
+            break;
+        }
+        for (size_t i = 0; i < count && !finished; i++) {
+            if (fds[i].revents) {
+                finished = watched[i];
+            }
+        }
+    }
+    free(fds);
+    free(watched);
+
+    int status;
+    pid_t result;
+    do {
+        result = waitpid(finished->pid, &status, 0);
+    } while (result == -1 && errno == EINTR);
+    started->running--;
+    return finish_invocation(finished, result == -1 ? 1 : exit_status(status));
+}
+
+// xargs' statuses: 123 if any command failed, and 127 if one couldn't start
+static int combine_status(int combined, int status) {
+    if (status == 127 || combined == 127) {
+        return 127;
+    }
+    return status != 0 ? 123 : combined;
+}
+
+// parallel runs a command for each line of its input, or of the file given
+// with -a, on up to -j commands at once, by default one per core. Blank lines
+// are skipped. With -n, each command takes up to that many items, or as many
+// as fit in ARG_MAX if it's 0. With -k, each command's output is held in a
+// temporary file and written out in input order.
+int map_command(char **argv, int in, int out) {
+    map_options options;
+    if (!parse_options(argv, &options)) {
+        usage();
+        return 2;
+    }
+    int input = in;
+    if (options.file) {
+        input = open(options.file, O_RDONLY | O_CLOEXEC);
+        if (input == -1) {
+            perror(options.file);
+            return 1;
+        }
+    }
+    int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    size_t budget = argument_budget();
+    for (size_t i = 0; options.template[i]; i++) {
+        budget -= budget > argument_size(options.template[i]) ? argument_size(options.template[i]) : budget;
+    }
+    size_t batch = takes_one_item(options.template) ? 1 : options.batch;
+    size_t limit = batch > 0 ? batch : budget / sizeof(char *) + 1;
+    char **items = malloc(sizeof(char *) * (batch > 0 ? batch : 1024));
+    size_t items_capacity = batch > 0 ? batch : 1024;
+
+    input_reader *reader = init_input_reader(input);
+    invocations started = {
+        .list = malloc(sizeof(invocation) * options.workers * 2),
+        .capacity = options.workers * 2,
+    };
+    int combined = 0;
+    char *held = NULL;
+    bool more = true;
+    while (more || started.running > 0) {
+        while (more && started.running < options.workers) {
+            if (batch == 0 && items_capacity < limit) {
+                // Grown as needed, since as many as fit could be a great many
+                items_capacity = limit;
+                items = realloc(items, sizeof(char *) * items_capacity);
+            }
+            size_t count = read_batch(reader, items, limit, budget, &held);
+            if (count == 0) {
+                more = false;
+                break;
+            }
+
+            char **command = build_argv(options.template, items, count);
+            invocation *invocation = add_invocation(&started);
+            invocation->output = options.keep_order ? open_temporary_file() : -1;
+            invocation->pid = spawn_process(command, null,
+                                            invocation->output != -1 ? invocation->output : out);
+            free_argv(command);
+            for (size_t i = 0; i < count; i++) {
+                free(items[i]);
+            }
+            if (invocation->pid == -1) {
+                fprintf(stderr, "parallel: %s: command not found\n", options.template[0]);
+                invocation->pidfd = -1;
+                combined = combine_status(combined, finish_invocation(invocation, 127));
+                continue;
+            }
+            invocation->pidfd = pidfd_open(invocation->pid, 0);
+            invocation->done = false;
+            started.running++;
+        }
+        if (started.running > 0) {
+            combined = combine_status(combined, wait_any(&started));
+        }
+        flush_in_order(&started, out);
+    }
+
+    free(held);
+    free(items);
+    free(started.list);
+    free_input_reader(reader);
+    close(null);
+    if (input != in) {
+        close(input);
+    }
+    return combined;
+}
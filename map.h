@@ -0,0 +1,7 @@
+#pragma once
+
+
+// The parallel (or map) builtin, an xargs -P that runs in the shell. Commands
+// are started through the same path as any other, with a fixed pool of them
+// running at once.
+int map_command(char **argv, int in, int out);
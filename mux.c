@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "mux.h"
+#include "util.h"
+
+
+#define MUX_ENV "NUSH_MUX"
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+// A line longer than this is passed on in pieces rather than held whole
+#define MAX_LINE_LENGTH (64 * 1024)
+
+#define MAX_EVENTS 64
+
+// Most output held for one of a job's pipes before the shell stops reading it,
+// leaving the job to wait until what's held has been written
+#define MAX_HELD (1024 * 1024)
+
+// Most reads from one pipe in a sync, so a job that never stops writing can't
+// hold it up forever
+#define SYNC_READS (16)
+
+enum {
+    TARGET_STDOUT,
+    TARGET_STDERR,
+    TARGET_COUNT
+};
+
+
+// One of a job's pipes. The epoll instance holds it until the job closes its
+// end, except while it's parked for having too much output held. Only the
+// reader thread reads it; held, parked and the list are under the lock.
+struct mux_source {
+    int fd;
+    int target;
+    char tag[24];
+    string_buffer *partial; // The line being read, until its newline comes
+    size_t held;            // Bytes passed on but not yet being written
+    bool parked;
+    struct mux_source *previous;
+    struct mux_source *next;
+};
+typedef struct mux_source mux_source;
+
+// Lines move from the reader to the writer through pending, which the writer
+// swaps with writing before it writes them, so neither waits on the other. A
+// sync is a generation: the reader marks it drained once it has read all that
+// is waiting, and the writer marks it written after writing what came before.
+struct output_mux {
+    bool enabled;
+    bool tagged;
+    bool settings_known;
+
+    pid_t owner; // The process whose threads these are, or 0 if not started
+    int epoll;
+    int wakeup;
+    pthread_t reader;
+    pthread_t writer;
+    int targets[TARGET_COUNT];
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    string_buffer *pending[TARGET_COUNT];
+    string_buffer *writing[TARGET_COUNT];
+    mux_source *first;
+    size_t sources;
+    unsigned long requested;
+    unsigned long drained;
+    unsigned long written;
+    bool stopping;
+};
+typedef struct output_mux output_mux;
+
+static output_mux mux = {
+    .epoll = -1,
+    .wakeup = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+
+static void load_settings(void) {
+    if (!mux.settings_known) {
+        char *setting = getenv(MUX_ENV);
+        mux.enabled = setting && *setting && strcmp(setting, "0") != 0;
+        mux.tagged = setting && strcmp(setting, "tag") == 0;
+        mux.settings_known = true;
+    }
+}
+
+bool output_mux_running(void) {
+    return mux.owner != 0 && mux.owner == getpid();
+}
+
+bool output_muxed(void) {
+    load_settings();
+    return mux.enabled;
+}
+
+void set_output_mux(bool enabled) {
+    load_settings();
+    mux.enabled = enabled;
+}
+
+void set_output_tags(bool tagged) {
+    load_settings();
+    mux.tagged = tagged;
+}
+
+
+// Reader thread
+
+// Passes on text, with the source's tag before each line, and holds back the
+// end of the last line if it's not complete. The caller holds the lock.
+static void push_lines(mux_source *source, const char *data, size_t length) {
+    string_buffer *pending = mux.pending[source->target];
+    while (length > 0) {
+        const char *newline = memchr(data, '\n', length);
+        size_t line_length = newline ? (size_t) (newline - data) + 1 : length;
+        if (!newline && string_buffer_length(source->partial) + length < MAX_LINE_LENGTH) {
+            push_string(source->partial, data, length);
+            return;
+        }
+        push_string(pending, source->tag, strlen(source->tag));
+        push_string(pending, string_buffer_contents(source->partial),
+                    string_buffer_length(source->partial));
+        push_string(pending, data, line_length);
+        source->held += strlen(source->tag) + string_buffer_length(source->partial) + line_length;
+        reset_string_buffer(source->partial);
+        data += line_length;
+        length -= line_length;
+    }
+}
+
+// The job has closed the pipe, so the last line is passed on even without its
+// newline. Tagged lines always get one, since the next line starts with a tag.
+static void close_source(mux_source *source) {
+    pthread_mutex_lock(&mux.lock);
+    if (string_buffer_length(source->partial) > 0) {
+        string_buffer *pending = mux.pending[source->target];
+        push_string(pending, source->tag, strlen(source->tag));
+        push_string(pending, string_buffer_contents(source->partial),
+                    string_buffer_length(source->partial));
+        if (source->tag[0]) {
+            push_string(pending, "\n", 1);
+        }
+    }
+    if (source->previous) {
+        source->previous->next = source->next;
+    } else {
+        mux.first = source->next;
+    }
+    if (source->next) {
+        source->next->previous = source->previous;
+    }
+    mux.sources--;
+    pthread_cond_broadcast(&mux.changed);
+    pthread_mutex_unlock(&mux.lock);
+
+    epoll_ctl(mux.epoll, EPOLL_CTL_DEL, source->fd, NULL);
+    close(source->fd);
+    free_string_buffer(source->partial);
+    free(source);
+}
+
+// Stops reading a source that has too much output held, until release_held.
+// The caller holds the lock.
+static bool park_source(mux_source *source) {
+    if (source->held < MAX_HELD) {
+        return false;
+    }
+    source->parked = true;
+    epoll_ctl(mux.epoll, EPOLL_CTL_DEL, source->fd, NULL);
+    return true;
+}
+
+// Once what was pending is being written, nothing is held for any source, and
+// those that were parked are read again. The caller holds the lock.
+static void release_held(void) {
+    for (mux_source *source = mux.first; source; source = source->next) {
+        source->held = 0;
+        if (source->parked) {
+            source->parked = false;
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = source};
+            epoll_ctl(mux.epoll, EPOLL_CTL_ADD, source->fd, &event);
+        }
+    }
+}
+
+// Reads once, or up to reads times if more is waiting. Returns false if the
+// source was closed.
+static bool read_source(mux_source *source, size_t reads) {
+    static char buffer[READ_CHUNK_SIZE];
+    for (size_t i = 0; i < reads; i++) {
+        pthread_mutex_lock(&mux.lock);
+        bool parked = park_source(source);
+        pthread_mutex_unlock(&mux.lock);
+        if (parked) {
+            return true;
+        }
+        ssize_t count = read(source->fd, buffer, sizeof(buffer));
+        if (count == -1 && errno == EINTR) {
+            i--;
+            continue;
+        }
+        if (count == -1 && errno == EAGAIN) {
+            return true;
+        }
+        if (count <= 0) {
+            close_source(source);
+            return false;
+        }
+        pthread_mutex_lock(&mux.lock);
+        push_lines(source, buffer, count);
+        pthread_cond_broadcast(&mux.changed);
+        pthread_mutex_unlock(&mux.lock);
+        if (count < (ssize_t) sizeof(buffer)) {
+            return true;
+        }
+    }
+    return true;
+}
+
+// Reads everything the jobs have written so far, without waiting for more
+static void drain_sources(void) {
+    size_t passes = mux.sources / MAX_EVENTS + 1;
+    for (size_t pass = 0; pass < passes; pass++) {
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(mux.epoll, events, MAX_EVENTS, 0);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr) {
+                read_source(events[i].data.ptr, SYNC_READS);
+            }
+        }
+        if (count < MAX_EVENTS) {
+            return;
+        }
+    }
+}
+
+static void *read_jobs(void *arg) {
+    (void) arg;
+    while (1) {
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(mux.epoll, events, MAX_EVENTS, -1);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count == -1) {
+            return NULL;
+        }
+
+        bool woken = false;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr) {
+                read_source(events[i].data.ptr, 1);
+            } else {
+                uint64_t wakeups;
+                if (read(mux.wakeup, &wakeups, sizeof(wakeups)) == -1) {
+                    // Already woken
+                }
+                woken = true;
+            }
+        }
+        if (!woken) {
+            continue;
+        }
+
+        pthread_mutex_lock(&mux.lock);
+        unsigned long generation = mux.requested;
+        pthread_mutex_unlock(&mux.lock);
+        drain_sources();
+        pthread_mutex_lock(&mux.lock);
+        mux.drained = generation;
+        bool stopping = mux.stopping;
+        pthread_cond_broadcast(&mux.changed);
+        pthread_mutex_unlock(&mux.lock);
+        if (stopping) {
+            return NULL;
+        }
+    }
+}
+
+
+// Writer thread
+
+static bool nothing_pending(void) {
+    for (int i = 0; i < TARGET_COUNT; i++) {
+        if (string_buffer_length(mux.pending[i]) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *write_lines(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&mux.lock);
+    while (1) {
+        // Once stopping, the reader has one last generation to drain
+        while (nothing_pending() && mux.written == mux.drained &&
+               !(mux.stopping && mux.drained == mux.requested)) {
+            pthread_cond_wait(&mux.changed, &mux.lock);
+        }
+        if (nothing_pending() && mux.written == mux.drained) {
+            break;
+        }
+
+        unsigned long generation = mux.drained;
+        for (int i = 0; i < TARGET_COUNT; i++) {
+            string_buffer *lines = mux.pending[i];
+            mux.pending[i] = mux.writing[i];
+            mux.writing[i] = lines;
+        }
+        release_held();
+        pthread_mutex_unlock(&mux.lock);
+
+        for (int i = 0; i < TARGET_COUNT; i++) {
+            write_all(mux.targets[i], string_buffer_contents(mux.writing[i]),
+                      string_buffer_length(mux.writing[i]));
+            reset_string_buffer(mux.writing[i]);
+        }
+
+        pthread_mutex_lock(&mux.lock);
+        mux.written = generation;
+        pthread_cond_broadcast(&mux.changed);
+    }
+    pthread_mutex_unlock(&mux.lock);
+    return NULL;
+}
+
+
+static bool start_mux(void) {
+    if (output_mux_running()) {
+        return true;
+    }
+    mux.epoll = epoll_create1(EPOLL_CLOEXEC);
+    mux.wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (mux.epoll == -1 || mux.wakeup == -1) {
+        perror("Error: ");
+        return false;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(mux.epoll, EPOLL_CTL_ADD, mux.wakeup, &event);
+
+    // Kept apart from the shell's own, which redirections may move
+    mux.targets[TARGET_STDOUT] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    mux.targets[TARGET_STDERR] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    for (int i = 0; i < TARGET_COUNT; i++) {
+        mux.pending[i] = init_string_buffer();
+        mux.writing[i] = init_string_buffer();
+    }
+    mux.owner = getpid();
+    pthread_create(&mux.reader, NULL, read_jobs, NULL);
+    pthread_create(&mux.writer, NULL, write_lines, NULL);
+    return true;
+}
+
+bool open_job_output(job_output *output) {
+    if (!output_muxed() || !start_mux()) {
+        return false;
+    }
+    if (pipe2(output->out, O_CLOEXEC) == -1) {
+        return false;
+    }
+    if (pipe2(output->err, O_CLOEXEC) == -1) {
+        close(output->out[0]);
+        close(output->out[1]);
+        return false;
+    }
+    return true;
+}
+
+void redirect_job_output(job_output *output) {
+    dup2(output->out[1], STDOUT_FILENO);
+    dup2(output->err[1], STDERR_FILENO);
+    close(output->out[0]);
+    close(output->out[1]);
+    close(output->err[0]);
+    close(output->err[1]);
+}
+
+static void add_source(int fd, int target, int job) {
+    mux_source *source = malloc(sizeof(mux_source));
+    source->fd = fd;
+    source->target = target;
+    source->tag[0] = '\0';
+    if (mux.tagged && job > 0) {
+        snprintf(source->tag, sizeof(source->tag), "[%d] ", job);
+    }
+    source->partial = init_string_buffer();
+    source->held = 0;
+    source->parked = false;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_lock(&mux.lock);
+    source->previous = NULL;
+    source->next = mux.first;
+    if (mux.first) {
+        mux.first->previous = source;
+    }
+    mux.first = source;
+    mux.sources++;
+    pthread_mutex_unlock(&mux.lock);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = source};
+    epoll_ctl(mux.epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+void mux_job_output(job_output *output, int job) {
+    close(output->out[1]);
+    close(output->err[1]);
+    add_source(output->out[0], TARGET_STDOUT, job);
+    add_source(output->err[0], TARGET_STDERR, job);
+}
+
+// Starts a new generation and waits for the reader and writer to catch up with
+// it, stopping them afterwards if stop is set
+static void wait_for_generation(bool stop) {
+    pthread_mutex_lock(&mux.lock);
+    unsigned long generation = ++mux.requested;
+    mux.stopping = stop;
+    pthread_mutex_unlock(&mux.lock);
+    uint64_t wakeup = 1;
+    if (write(mux.wakeup, &wakeup, sizeof(wakeup)) == -1) {
+        // The counter is already full, so the reader will wake anyway
+    }
+    pthread_mutex_lock(&mux.lock);
+    while (mux.written < generation) {
+        pthread_cond_wait(&mux.changed, &mux.lock);
+    }
+    pthread_mutex_unlock(&mux.lock);
+}
+
+void sync_output_mux(void) {
+    if (output_mux_running()) {
+        wait_for_generation(false);
+    }
+}
+
+// Passes on the output of jobs still running after the shell has gone, from a
+// process of its own with the threads' work done in turn
+static void forward_remaining(void) {
+    if (mux.sources == 0 || fork() != 0) {
+        return;
+    }
+    pthread_mutex_lock(&mux.lock);
+    release_held();
+    pthread_mutex_unlock(&mux.lock);
+    while (mux.sources > 0) {
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(mux.epoll, events, MAX_EVENTS, -1);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count == -1) {
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr) {
+                read_source(events[i].data.ptr, 1);
+            }
+        }
+        pthread_mutex_lock(&mux.lock);
+        for (int i = 0; i < TARGET_COUNT; i++) {
+            write_all(mux.targets[i], string_buffer_contents(mux.pending[i]),
+                      string_buffer_length(mux.pending[i]));
+            reset_string_buffer(mux.pending[i]);
+        }
+        release_held();
+        pthread_mutex_unlock(&mux.lock);
+    }
+    _exit(0);
+}
+
+void close_output_mux(void) {
+    if (!output_mux_running()) {
+        return;
+    }
+    wait_for_generation(true);
+    pthread_join(mux.reader, NULL);
+    pthread_join(mux.writer, NULL);
+    forward_remaining();
+    mux.owner = 0;
+}
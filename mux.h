@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+
+
+// Background jobs normally write straight to the shell's stdout and stderr,
+// where the output of jobs running together interleaves mid-line. With the
+// multiplexer on, from $NUSH_MUX or set -o mux, each job writes into pipes of
+// its own instead. A thread in the shell reads every pipe through one epoll
+// instance and passes on only whole lines, tagged with the job's number if
+// set -o tag is on, and another thread writes them out in large batches. The
+// jobs don't wait on a slow terminal or reader, since the shell holds their
+// output until it can be written, up to a megabyte or so from each pipe.
+
+// The pipes a job's stdout and stderr are sent through
+struct job_output {
+    int out[2];
+    int err[2];
+};
+typedef struct job_output job_output;
+
+
+// $NUSH_MUX turns the multiplexer on if it's set and not 0, and also tags
+// lines if it's "tag"
+bool output_muxed(void);
+void set_output_mux(bool enabled);
+void set_output_tags(bool tagged);
+
+// Whether this process holds jobs' output, so it can't be replaced by exec
+bool output_mux_running(void);
+
+// Opens pipes for a job about to be started, starting the multiplexer if it's
+// the first. Returns false if the job should write to the shell's output.
+bool open_job_output(job_output *output);
+
+// In the job, after it's forked
+void redirect_job_output(job_output *output);
+
+// In the shell once the job has started, or failed to, handing the pipes to the
+// multiplexer. Lines are tagged with job if it isn't 0.
+void mux_job_output(job_output *output, int job);
+
+// Waits until everything jobs have written so far has been written out, so it
+// comes before whatever the shell writes next
+void sync_output_mux(void);
+
+// Writes out everything jobs have written so far. Jobs still running are left
+// to a process of their own that passes on the rest of their output, so the
+// shell can exit without waiting for them. A child of the shell leaves the
+// multiplexer alone.
+void close_output_mux(void);
@@ -0,0 +1,176 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "parallel.h"
+#include "parser.h"
+#include "tokens.h"
+
+
+// Chunks handed out per thread, so one slow chunk doesn't stall the others
+#define CHUNKS_PER_THREAD 4
+
+// Below this a chunk isn't worth the hand-off
+#define MIN_CHUNK_SIZE (64 * 1024)
+
+
+struct parse_chunk {
+    char *input;
+    size_t length;
+    bool first;
+
+    parse_tree *tree;
+    bool lexed;    // No lexing errors
+    bool complete; // The grammar used up every token
+};
+typedef struct parse_chunk parse_chunk;
+
+struct parse_job {
+    parse_chunk *chunks;
+    size_t chunk_count;
+    atomic_size_t next_chunk;
+};
+typedef struct parse_job parse_job;
+
+
+static void parse_chunk_input(parse_chunk *chunk) {
+    lexer_token_list *tokens = init_token_list();
+    lexer_context *lexer = init_lexer_borrowed(chunk->input, chunk->length);
+
+    lexer_token *error = lex_tokens(lexer, tokens);
+    chunk->lexed = error == NULL;
+    if (error) {
+        chunk->tree = parse_error(get_token_value(error));
+        chunk->complete = false;
+    } else {
+        chunk->tree = parse_prefix(tokens);
+        lexer_token *next = peek_token(tokens);
+        chunk->complete = next == NULL;
+        // Past the first chunk the tree would have been a list with this error
+        // somewhere inside it, so like parse() report the token left over
+        if (next && (!chunk->first || chunk->tree->type != PARSE_TREE_ERROR)) {
+            free_parse_tree(chunk->tree);
+            chunk->tree = unexpected_token_error(next);
+        }
+    }
+
+    free_token_list(tokens);
+    free_lexer(lexer);
+}
+
+static void *parse_worker(void *arg) {
+    parse_job *job = arg;
+    while (1) {
+        size_t index = atomic_fetch_add(&job->next_chunk, 1);
+        if (index >= job->chunk_count) {
+            return NULL;
+        }
+        parse_chunk_input(&job->chunks[index]);
+    }
+}
+
+static parse_tree *take_tree(parse_chunk *chunk) {
+    parse_tree *tree = chunk->tree;
+    chunk->tree = NULL;
+    return tree;
+}
+
+static bool is_separator(char c) {
+    return c == CHAR_SPACE || c == CHAR_TAB || c == CHAR_NEWLINE;
+}
+
+// Cuts input into at most count chunks at list boundaries. Each cut is moved past
+// any further blank lines so that no chunk starts with a newline, which would
+// parse as an extra empty item.
+static size_t split_input(char *input, size_t length, parse_chunk *chunks, size_t count) {
+    size_t chunk_count = 0;
+    size_t start = 0;
+    for (size_t i = 1; i < count && start < length; i++) {
+        size_t target = length / count * i;
+        if (target <= start || target - start < MIN_CHUNK_SIZE) {
+            continue;
+        }
+        size_t end = find_list_boundary(input + start, target - start);
+        if (end == 0) {
+            continue;
+        }
+        end += start;
+        while (end < length && is_separator(input[end])) {
+            end++;
+        }
+        if (end >= length) {
+            break;
+        }
+        chunks[chunk_count].input = input + start;
+        chunks[chunk_count].length = end - start;
+        chunks[chunk_count].first = chunk_count == 0;
+        chunk_count++;
+        start = end;
+    }
+    chunks[chunk_count].input = input + start;
+    chunks[chunk_count].length = length - start;
+    chunks[chunk_count].first = chunk_count == 0;
+    return chunk_count + 1;
+}
+
+// Lexes and parses input split at top-level list boundaries on up to threads
+// threads, then splices the pieces back together in order. The result is the
+// same tree a single lexer and parser would have built, with lexing errors
+// reported as an error tree. The input is decoded in place but stays owned by
+// the caller.
+parse_tree *parse_parallel(char *input, size_t length, size_t threads) {
+    size_t max_chunks = threads * CHUNKS_PER_THREAD;
+    parse_chunk *chunks = malloc(sizeof(parse_chunk) * max_chunks);
+
+    parse_job job;
+    job.chunks = chunks;
+    job.chunk_count = split_input(input, length, chunks, max_chunks);
+    atomic_init(&job.next_chunk, 0);
+
+    size_t worker_count = threads < job.chunk_count ? threads : job.chunk_count;
+    pthread_t *workers = malloc(sizeof(pthread_t) * worker_count);
+    size_t started = 0;
+    for (size_t i = 1; i < worker_count; i++) {
+        if (pthread_create(&workers[started], NULL, parse_worker, &job) == 0) {
+            started++;
+        }
+    }
+    parse_worker(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    // A single lexer would have stopped at the first lexing error anywhere,
+    // and a single parser at the first chunk it couldn't finish
+    parse_tree *tree = NULL;
+    for (size_t i = 0; i < job.chunk_count && !tree; i++) {
+        if (!chunks[i].lexed) {
+            tree = take_tree(&chunks[i]);
+        }
+    }
+    for (size_t i = 0; i < job.chunk_count && !tree; i++) {
+        if (!chunks[i].complete) {
+            tree = take_tree(&chunks[i]);
+        }
+    }
+    if (!tree) {
+        // Splice each chunk onto the one before, so only its own spine is walked
+        tree = take_tree(&chunks[0]);
+        parse_tree *last = tree;
+        for (size_t i = 1; i < job.chunk_count; i++) {
+            parse_tree *next = take_tree(&chunks[i]);
+            splice_parse_tree(last, next);
+            last = next;
+        }
+    }
+    for (size_t i = 0; i < job.chunk_count; i++) {
+        if (chunks[i].tree) {
+            free_parse_tree(chunks[i].tree);
+        }
+    }
+
+    free(chunks);
+    return tree;
+}
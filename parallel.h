@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "parser.h"
+
+
+parse_tree *parse_parallel(char *input, size_t length, size_t threads);
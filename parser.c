@@ -3,115 +3,105 @@
 #include <string.h>
 
 #include "parser.h"
+#include "stats.h"
 #include "tokens.h"
+#include "util.h"
 
 
+struct parser_context {
+    lexer_token_list *tokens;
+    arena *arena;
+    size_t nodes;
+};
+typedef struct parser_context parser_context;
 
-static parse_tree *parse_command(lexer_token_list *tokens);
-static parse_tree *parse_pipeline(lexer_token_list *tokens);
-static parse_tree *parse_list(lexer_token_list *tokens);
 
-static parse_tree *init_tree(void) {
-    parse_tree *tree = malloc(sizeof(parse_tree));
+static parse_tree *init_tree(parser_context *context) {
+    parse_tree *tree = arena_alloc(context->arena, sizeof(parse_tree));
+    context->nodes++;
     tree->type = PARSE_TREE_NONE;
     tree->argc = 0;
-    for (size_t i = 0; i < 256; i++) {
-        tree->argv[i] = NULL;
-    }
-    tree->redirections[0] = NULL;
-    tree->redirections[1] = NULL;
+    tree->argv = NULL;
+    tree->redirection_count = 0;
+    tree->redirections = NULL;
     tree->left = NULL;
     tree->right = NULL;
+    tree->arena = context->arena;
     return tree;
 }
 
-static parse_tree *error_tree(char *message) {
-    parse_tree *tree = init_tree();
+static parse_tree *error_tree(parser_context *context, char *message) {
+    parse_tree *tree = init_tree(context);
     tree->type = PARSE_TREE_ERROR;
     tree->argc = 1;
-    tree->argv[0] = malloc(sizeof(char) * strlen(message) + 1);
-    strcpy(tree->argv[0], message);
+    tree->argv = arena_alloc(context->arena, sizeof(char *) * 2);
+    tree->argv[0] = arena_strndup(context->arena, message, strlen(message));
+    tree->argv[1] = NULL;
     return tree;
 }
 
-static parse_tree *parse_command(lexer_token_list *tokens) {
+// Token values are spans into the lexer's buffer, so the tree keeps its own copy
+static char *copy_token_value(parser_context *context, lexer_token *token) {
+    return arena_strndup(context->arena, get_token_value(token), get_token_length(token));
+}
+
+static bool is_redirection(token_type type) {
+    return type == TOKEN_REDIR_IN ||
+           type == TOKEN_REDIR_OUT;
+}
+
+// Parses a simple command, or an empty tree if the next token can't start one
+static parse_tree *parse_command(parser_context *context) {
+    lexer_token_list *tokens = context->tokens;
     if (token_list_empty(tokens)) {
-        return init_tree();
-    }
-    
-    lexer_token_list *original_tokens = copy_token_list(tokens);
-    lexer_token *next = peek_token(tokens);
-    if (get_token_type(next) != TOKEN_WORD && get_token_type(next) != TOKEN_SUBSHELL_OPEN) {
-        free_token_list_container(original_tokens);
-        return init_tree();
+        return init_tree(context);
     }
 
-    if (get_token_type(next) == TOKEN_SUBSHELL_OPEN) {
-        consume_token(tokens); // Eat the (
-        parse_tree *subexp = parse_list(tokens);
-        next = peek_token(tokens);
-        if (!next || get_token_type(next) != TOKEN_SUBSHELL_CLOSE) {
-            free_parse_tree(subexp);
-            free_token_list_container(original_tokens);
-            return error_tree("Expected ) to terminate subexpression");
-        }
-        consume_token(tokens);
-        return subexp;
+    lexer_token *next = peek_token(tokens);
+    if (get_token_type(next) != TOKEN_WORD) {
+        return init_tree(context);
     }
 
-    // Otherwise, have a word
-    parse_tree *tree = init_tree();
-    tree->type = PARSE_TREE_COMMAND;
-
+    // Count the arguments and redirections first so
+    // they can be laid out in arrays of exactly the right size.
+    size_t start = mark_tokens(tokens);
+    size_t argc = 0;
     while (next && get_token_type(next) == TOKEN_WORD) {
-        char *value = get_token_value(next);
-        tree->argv[tree->argc] = malloc((sizeof(char) * strlen(value)) + 1);
-        strcpy(tree->argv[tree->argc], value);
-        tree->argc++;
-
+        argc++;
         consume_token(tokens);
         next = peek_token(tokens);
     }
 
-    // First redirection
-    if (next && (get_token_type(next) == TOKEN_REDIR_IN || get_token_type(next) == TOKEN_REDIR_OUT)) {
-        redir_type redir1_type = get_token_type(next) == TOKEN_REDIR_IN ? REDIR_IN : REDIR_OUT;
+    size_t redirection_count = 0;
+    while (next && is_redirection(get_token_type(next))) {
         consume_token(tokens);
         next = consume_token(tokens);
-        if (get_token_type(next) != TOKEN_WORD) {
-            free_parse_tree(tree);
-            free_token_list_container(original_tokens);
-            return error_tree("Redirection must be followed by a filename");
+        if (!next || get_token_type(next) != TOKEN_WORD) {
+            return error_tree(context, "Redirection must be followed by a filename");
         }
-        redir_info *redir1_info = malloc(sizeof(redir_info));
-        redir1_info->type = redir1_type;
-        char *redir1_value = get_token_value(next);
-        redir1_info->target_filename = malloc(sizeof(char) * strlen(redir1_value) + 1);
-        strcpy(redir1_info->target_filename, redir1_value);
-        tree->redirections[0] = redir1_info;
+        redirection_count++;
+        next = peek_token(tokens);
     }
-    
-    next = peek_token(tokens);
+    rewind_tokens(tokens, start);
 
-    // Second redirection
-    if (next && (get_token_type(next) == TOKEN_REDIR_IN || get_token_type(next) == TOKEN_REDIR_OUT)) {
-        redir_type redir2_type = get_token_type(next) == TOKEN_REDIR_IN ? REDIR_IN : REDIR_OUT;
-        consume_token(tokens);
+    parse_tree *tree = init_tree(context);
+    tree->type = PARSE_TREE_COMMAND;
+
+    tree->argc = argc;
+    tree->argv = arena_alloc(context->arena, sizeof(char *) * (argc + 1));
+    for (size_t i = 0; i < argc; i++) {
+        tree->argv[i] = copy_token_value(context, consume_token(tokens));
+    }
+    tree->argv[argc] = NULL;
+
+    tree->redirection_count = redirection_count;
+    tree->redirections = arena_alloc(context->arena, sizeof(redir_info) * redirection_count);
+    for (size_t i = 0; i < redirection_count; i++) {
         next = consume_token(tokens);
-        if (get_token_type(next) != TOKEN_WORD) {
-            free_parse_tree(tree);
-            free_token_list_container(original_tokens);
-            return error_tree("Redirection must be followed by a filename");
-        }
-        redir_info *redir2_info = malloc(sizeof(redir_info));
-        redir2_info->type = redir2_type;
-        char *redir2_value = get_token_value(next);
-        redir2_info->target_filename = malloc(sizeof(char) * strlen(redir2_value) + 1);
-        strcpy(redir2_info->target_filename, redir2_value);
-        tree->redirections[1] = redir2_info;
+        tree->redirections[i].type = get_token_type(next) == TOKEN_REDIR_IN ? REDIR_IN : REDIR_OUT;
+        tree->redirections[i].target_filename = copy_token_value(context, consume_token(tokens));
     }
 
-    free_token_list_container(original_tokens);
     return tree;
 }
 
@@ -123,23 +113,8 @@ static void eat_newlines(lexer_token_list *tokens) {
     }
 }
 
-static parse_tree *parse_pipeline(lexer_token_list *tokens) {
-    parse_tree *cmd1 = parse_command(tokens);
-    lexer_token *next = peek_token(tokens);
-
-    if (next && get_token_type(next) == TOKEN_PIPE) {
-        consume_token(tokens);
-        eat_newlines(tokens);
-        parse_tree *pipe_rest = parse_pipeline(tokens);
-
-        parse_tree *tree = init_tree();
-        tree->type = PARSE_TREE_PIPE;
-        tree->left = cmd1;
-        tree->right = pipe_rest;
-        return tree;
-    }
-
-    return cmd1;
+static bool is_pipeline_operator(token_type type) {
+    return type == TOKEN_PIPE;
 }
 
 static bool is_list_operator(token_type type) {
@@ -164,6 +139,8 @@ static parse_tree_type get_tree_type_for_token(token_type type) {
             return PARSE_TREE_LIST;
         case TOKEN_BACKGROUND:
             return PARSE_TREE_BACKGROUND;
+        case TOKEN_PIPE:
+            return PARSE_TREE_PIPE;
         default:
             return PARSE_TREE_NONE;
     }
@@ -174,70 +151,192 @@ static bool requires_right_operand(parse_tree_type type) {
            type == PARSE_TREE_OR;
 }
 
-static parse_tree *parse_command_list(lexer_token_list *tokens) {
-    parse_tree *pipe1 = parse_pipeline(tokens);
-    lexer_token *next = peek_token(tokens);
-
-    if (next && is_command_list_operator(get_token_type(next))) {
-        consume_token(tokens);
-        eat_newlines(tokens);
-        parse_tree *command_list_rest = parse_command_list(tokens);
-
-        parse_tree *tree = init_tree();
-        tree->type = get_tree_type_for_token(get_token_type(next));
-        tree->left = pipe1;
-        tree->right = command_list_rest;
-        return tree;
+// Each rule of the grammar but command is a chain of operands joined by its
+// operators, and each chain's operands are chains of the next rule down
+enum chain_level {
+    CHAIN_LIST,
+    CHAIN_COMMAND_LIST,
+    CHAIN_PIPELINE,
+    CHAIN_SUBSHELL, // Not a chain, but a ( waiting for its list and )
+};
+typedef enum chain_level chain_level;
+
+// A chain being parsed. It leans right, so new operators only ever take over
+// the right operand of the last node added.
+struct chain_frame {
+    chain_level level;
+    parse_tree *root;
+    parse_tree *tail; // Last operator node, NULL while root is the only operand
+};
+typedef struct chain_frame chain_frame;
+
+struct chain_stack {
+    chain_frame *frames;
+    size_t count;
+    size_t capacity;
+};
+typedef struct chain_stack chain_stack;
+
+static bool (*const chain_operators[])(token_type) = {
+    [CHAIN_LIST] = is_list_operator,
+    [CHAIN_COMMAND_LIST] = is_command_list_operator,
+    [CHAIN_PIPELINE] = is_pipeline_operator,
+};
+
+static void push_frame(chain_stack *stack, chain_level level) {
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity * 2;
+        stack->frames = realloc(stack->frames, sizeof(chain_frame) * stack->capacity);
     }
-    return pipe1;
+    chain_frame *frame = &stack->frames[stack->count++];
+    frame->level = level;
+    frame->root = NULL;
+    frame->tail = NULL;
 }
 
-static parse_tree *parse_list(lexer_token_list *tokens) {
-    parse_tree *cmd_list1 = parse_command_list(tokens);
-    lexer_token *next = peek_token(tokens);
-
-    if (next && is_list_operator(get_token_type(next))) {
-        consume_token(tokens);
-        eat_newlines(tokens);
-        parse_tree *list_rest = parse_list(tokens);
+// Starts the chains of level and every level below it, down to a command
+static void push_chains(chain_stack *stack, chain_level level) {
+    for (; level <= CHAIN_PIPELINE; level++) {
+        push_frame(stack, level);
+    }
+}
 
-        parse_tree *tree = init_tree();
-        tree->type = get_tree_type_for_token(get_token_type(next));
-        tree->left = cmd_list1;
-        tree->right = list_rest;
+// Parses a list. Chains and subshells are kept on a stack of their own rather
+// than parsed recursively, so neither a long script nor deeply nested
+// parentheses use more of the C stack. A command is parsed whenever the chain
+// on top needs an operand, and handed back down the stack as each chain it
+// completes ends.
+static parse_tree *parse_list(parser_context *context) {
+    lexer_token_list *tokens = context->tokens;
+    chain_stack stack;
+    stack.capacity = 16;
+    stack.count = 0;
+    stack.frames = malloc(sizeof(chain_frame) * stack.capacity);
+    push_chains(&stack, CHAIN_LIST);
+
+    while (1) {
+        lexer_token *next = peek_token(tokens);
+        if (next && get_token_type(next) == TOKEN_SUBSHELL_OPEN) {
+            consume_token(tokens); // Eat the (
+            push_frame(&stack, CHAIN_SUBSHELL);
+            push_chains(&stack, CHAIN_LIST);
+            continue;
+        }
 
-        return tree;
+        parse_tree *operand = parse_command(context);
+        while (1) {
+            chain_frame *frame = &stack.frames[stack.count - 1];
+            if (frame->level == CHAIN_SUBSHELL) {
+                stack.count--;
+                next = peek_token(tokens);
+                if (!next || get_token_type(next) != TOKEN_SUBSHELL_CLOSE) {
+                    operand = error_tree(context, "Expected ) to terminate subexpression");
+                } else {
+                    consume_token(tokens);
+                }
+                continue;
+            }
+
+            if (frame->tail) {
+                frame->tail->right = operand;
+            } else {
+                frame->root = operand;
+            }
+            next = peek_token(tokens);
+            if (next && chain_operators[frame->level](get_token_type(next))) {
+                consume_token(tokens);
+                eat_newlines(tokens);
+
+                parse_tree *tree = init_tree(context);
+                tree->type = get_tree_type_for_token(get_token_type(next));
+                if (frame->tail) {
+                    tree->left = frame->tail->right;
+                    frame->tail->right = tree;
+                } else {
+                    tree->left = frame->root;
+                    frame->root = tree;
+                }
+                frame->tail = tree;
+                push_chains(&stack, frame->level + 1);
+                break;
+            }
+
+            // The chain is complete, and is an operand of the one below
+            operand = frame->root;
+            if (--stack.count == 0) {
+                free(stack.frames);
+                return operand;
+            }
+        }
     }
-    
-    return cmd_list1;
+}
+
+// Parses as much of tokens as the grammar allows, leaving the cursor at the
+// first token it couldn't use
+parse_tree *parse_prefix(lexer_token_list *tokens) {
+    long long start = stats_clock();
+    parser_context context;
+    context.tokens = tokens;
+    context.arena = init_arena();
+    context.nodes = 0;
+    parse_tree *tree = parse_list(&context);
+    count_parsing(start, context.nodes);
+    return tree;
 }
 
 parse_tree *parse(lexer_token_list *tokens) {
     // So that we don't destroy the original input
-    lexer_token_list *copy = copy_token_list(tokens);
-    parse_tree *tree = parse_list(copy);
-    free_token_list_container(copy);
+    size_t start = mark_tokens(tokens);
+    parse_tree *tree = parse_prefix(tokens);
+    lexer_token *next = peek_token(tokens);
+    if (next && tree->type != PARSE_TREE_ERROR) {
+        // The grammar stopped short of the input
+        free_parse_tree(tree);
+        tree = unexpected_token_error(next);
+    }
+    rewind_tokens(tokens, start);
     return tree;
 }
 
-void free_parse_tree(parse_tree *tree) {
-    if (tree->left) {
-        free_parse_tree(tree->left);
-    }
-    if (tree->right) {
-        free_parse_tree(tree->right);
-    }
-    while (tree->argc > 0) {
-        tree->argc--;
-        free(tree->argv[tree->argc]);
-    }
-    if (tree->redirections[0]) {
-        free(tree->redirections[0]->target_filename);
-        free(tree->redirections[0]);
-    }
-    if (tree->redirections[1]) {
-        free(tree->redirections[1]->target_filename);
-        free(tree->redirections[1]);
+// A lone error tree, for failures found outside the grammar
+parse_tree *parse_error(const char *message) {
+    parser_context context;
+    context.tokens = NULL;
+    context.arena = init_arena();
+    context.nodes = 0;
+    return error_tree(&context, (char *) message);
+}
+
+parse_tree *unexpected_token_error(lexer_token *token) {
+    char message[64];
+    snprintf(message, sizeof(message), "Unexpected token %.*s",
+             (int) get_token_length(token), get_token_value(token));
+    return parse_error(message);
+}
+
+static bool continues_right(parse_tree *tree) {
+    return tree->type == PARSE_TREE_LIST ||
+           tree->type == PARSE_TREE_BACKGROUND ||
+           tree->type == PARSE_TREE_AND ||
+           tree->type == PARSE_TREE_OR;
+}
+
+// Replaces the empty operand that ends a list parsed from input ending in a
+// newline with rest. Input ending in & leaves it under a BACKGROUND node, since
+// newlines after & are skipped, and that node may itself be the right operand
+// of && or ||, so the whole right spine is walked. The result runs the same as
+// the tree the input followed by rest's input would have parsed to. list takes
+// over rest's arena.
+void splice_parse_tree(parse_tree *list, parse_tree *rest) {
+    parse_tree *last = list;
+    while (continues_right(last->right)) {
+        last = last->right;
     }
-    free(tree);
+    last->right = rest;
+    arena_adopt(list->arena, rest->arena);
+}
+
+// Releases the whole tree at once, since every node shares its arena
+void free_parse_tree(parse_tree *tree) {
+    free_arena(tree->arena);
 }
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 
 #include "tokens.h"
+#include "util.h"
 
 
 enum redir_type {
@@ -30,23 +31,34 @@ enum parse_tree_type {
 };
 typedef enum parse_tree_type parse_tree_type;
 
-// The big parse tree structure to represent sh programs
+// The parse tree structure to represent sh programs. Every node, argument and
+// redirection of a tree lives in the arena that parse() created for it.
 //
 typedef struct parse_tree parse_tree;
 struct parse_tree {
     parse_tree_type type;
 
+    // Null-terminated argument vector for commands
     size_t argc;
-    char *argv[256];
+    char **argv;
 
-    redir_info *redirections[2];
+    size_t redirection_count;
+    redir_info *redirections;
 
     // Child parse trees for binary operators
     parse_tree *left;
     parse_tree *right;
+
+    arena *arena;
 };
 
 
 parse_tree *parse(lexer_token_list *tokens);
+parse_tree *parse_prefix(lexer_token_list *tokens);
+
+parse_tree *parse_error(const char *message);
+parse_tree *unexpected_token_error(lexer_token *token);
+
+void splice_parse_tree(parse_tree *list, parse_tree *rest);
 
 void free_parse_tree(parse_tree *tree);
@@ -0,0 +1,191 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "path.h"
+#include "util.h"
+
+
+// What execvp searches when PATH isn't set
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+#define HASH_INITIAL_BUCKETS 64
+
+
+struct command_entry {
+    struct command_entry *next;
+    char *name;
+    char *path;
+    size_t hits;
+};
+typedef struct command_entry command_entry;
+
+// Chained, so entries can be dropped without tombstones
+struct command_hash {
+    command_entry **buckets;
+    size_t bucket_count;
+    size_t count;
+
+    // PATH the entries were found with
+    char *search_path;
+};
+typedef struct command_hash command_hash;
+
+static command_hash table;
+
+
+static void free_entry(command_entry *entry) {
+    free(entry->name);
+    free(entry->path);
+    free(entry);
+}
+
+void clear_command_hash(void) {
+    for (size_t i = 0; i < table.bucket_count; i++) {
+        command_entry *entry = table.buckets[i];
+        while (entry) {
+            command_entry *next = entry->next;
+            free_entry(entry);
+            entry = next;
+        }
+        table.buckets[i] = NULL;
+    }
+    table.count = 0;
+}
+
+static const char *search_path(void) {
+    const char *path = getenv("PATH");
+    return path ? path : DEFAULT_PATH;
+}
+
+// Starts the table over if PATH has changed since the entries were found
+static void check_search_path(void) {
+    const char *path = search_path();
+    if (table.search_path && strcmp(table.search_path, path) == 0) {
+        return;
+    }
+    if (!table.buckets) {
+        table.bucket_count = HASH_INITIAL_BUCKETS;
+        table.buckets = calloc(table.bucket_count, sizeof(command_entry *));
+    }
+    clear_command_hash();
+    free(table.search_path);
+    table.search_path = strdup(path);
+}
+
+static command_entry **find_entry(const char *name) {
+    command_entry **link = &table.buckets[hash_string(name) & (table.bucket_count - 1)];
+    while (*link && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void grow_table(void) {
+    size_t old_count = table.bucket_count;
+    command_entry **old_buckets = table.buckets;
+    table.bucket_count = old_count * 2;
+    table.buckets = calloc(table.bucket_count, sizeof(command_entry *));
+    for (size_t i = 0; i < old_count; i++) {
+        command_entry *entry = old_buckets[i];
+        while (entry) {
+            command_entry *next = entry->next;
+            command_entry **bucket = &table.buckets[hash_string(entry->name) & (table.bucket_count - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(old_buckets);
+}
+
+// Searches each directory of PATH in turn, as execvp would. An empty entry
+// means the current directory.
+static char *search_command(const char *name) {
+    const char *dir = table.search_path;
+    size_t name_length = strlen(name);
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_length = end ? (size_t) (end - dir) : strlen(dir);
+        char *candidate = malloc(dir_length + name_length + 2);
+        if (dir_length == 0) {
+            memcpy(candidate, name, name_length + 1);
+        } else {
+            memcpy(candidate, dir, dir_length);
+            candidate[dir_length] = '/';
+            memcpy(candidate + dir_length + 1, name, name_length + 1);
+        }
+
+        struct stat info;
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        if (!end) {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+const char *resolve_command(const char *name) {
+    if (strchr(name, '/')) {
+        return name;
+    }
+    check_search_path();
+
+    command_entry **link = find_entry(name);
+    if (*link) {
+        (*link)->hits++;
+        return (*link)->path;
+    }
+
+    char *path = search_command(name);
+    if (!path) {
+        return NULL;
+    }
+    command_entry *entry = malloc(sizeof(command_entry));
+    entry->next = NULL;
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 1;
+    *link = entry;
+    if (++table.count > table.bucket_count) {
+        grow_table();
+    }
+    return path;
+}
+
+bool forget_command(const char *name) {
+    if (!table.buckets) {
+        return false;
+    }
+    command_entry **link = find_entry(name);
+    command_entry *entry = *link;
+    if (!entry) {
+        return false;
+    }
+    *link = entry->next;
+    free_entry(entry);
+    table.count--;
+    return true;
+}
+
+void print_command_hash(int fd) {
+    check_search_path();
+    if (table.count == 0) {
+        dprintf(fd, "hash: hash table empty\n");
+        return;
+    }
+    dprintf(fd, "hits\tcommand\n");
+    for (size_t i = 0; i < table.bucket_count; i++) {
+        for (command_entry *entry = table.buckets[i]; entry; entry = entry->next) {
+            dprintf(fd, "%4zu\t%s\n", entry->hits, entry->path);
+        }
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+
+
+// Commands are looked up in PATH once and the absolute path they were found at
+// is remembered, so launching them again needs no search. The table starts over
+// whenever PATH changes.
+
+// Returns NULL if name isn't found. Names containing a slash are used as is.
+const char *resolve_command(const char *name);
+
+// Drops a remembered path that no longer works. Returns false if there was none.
+bool forget_command(const char *name);
+
+void clear_command_hash(void);
+void print_command_hash(int fd);
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+#include "program.h"
+#include "scan.h"
+
+
+#define PROGRAM_INITIAL_CAPACITY 64
+
+
+static program *init_program(void) {
+    program *prog = malloc(sizeof(program));
+    prog->capacity = PROGRAM_INITIAL_CAPACITY;
+    prog->code = malloc(sizeof(instruction) * prog->capacity);
+    prog->length = 0;
+    prog->references = 1;
+    prog->release = NULL;
+    prog->source = NULL;
+    return prog;
+}
+
+program *hold_program(program *program) {
+    program->references++;
+    return program;
+}
+
+void free_program(program *program) {
+    if (--program->references > 0) {
+        return;
+    }
+    if (program->release) {
+        program->release(program->source);
+    }
+    free(program->code);
+    free(program);
+}
+
+static void release_tree(void *tree) {
+    free_parse_tree(tree);
+}
+
+static size_t emit(program *prog, opcode op) {
+    if (prog->length >= prog->capacity) {
+        prog->capacity = prog->capacity * 2;
+        prog->code = realloc(prog->code, sizeof(instruction) * prog->capacity);
+    }
+    prog->code[prog->length].op = op;
+    prog->code[prog->length].target = 0;
+    return prog->length++;
+}
+
+static void emit_command(program *prog, opcode op, parse_tree *command) {
+    size_t index = emit(prog, op);
+    prog->code[index].command = command;
+}
+
+// Points a previously emitted jump or fork at the next instruction
+static void patch_target(program *prog, size_t index) {
+    prog->code[index].target = prog->length;
+}
+
+static void compile_node(program *prog, parse_tree *tree);
+
+// Code run in a forked child, which exits once it is done
+static void compile_child(program *prog, opcode op, parse_tree *tree) {
+    size_t fork = emit(prog, op);
+    compile_node(prog, tree);
+    emit(prog, OP_EXIT);
+    patch_target(prog, fork);
+}
+
+static void compile_stage(program *prog, parse_tree *stage) {
+    if (stage->type == PARSE_TREE_COMMAND) {
+        emit_command(prog, OP_SPAWN, stage);
+    } else {
+        compile_child(prog, OP_SUBSHELL, stage);
+    }
+}
+
+static void compile_pipeline(program *prog, parse_tree *tree) {
+    while (tree->type == PARSE_TREE_PIPE) {
+        emit(prog, OP_PIPE);
+        compile_stage(prog, tree->left);
+        tree = tree->right;
+    }
+    compile_stage(prog, tree);
+    emit(prog, OP_WAIT);
+}
+
+#define NO_JUMP ((size_t) -1)
+
+// Binary nodes lean right, so a long script or && chain is one long right spine.
+// It is walked in a loop and only left operands, whose depth is bounded by how
+// deeply parentheses nest, are compiled recursively. Every conditional jump
+// skips the rest of its right operand, which is the rest of the spine, so
+// pending jumps are threaded through their target fields and all patched once
+// the spine ends.
+static void compile_node(program *prog, parse_tree *tree) {
+    size_t pending = NO_JUMP;
+    while (tree) {
+        size_t jump;
+        parse_tree *right = NULL;
+        switch (tree->type) {
+            case PARSE_TREE_LIST:
+                compile_node(prog, tree->left);
+                right = tree->right;
+                break;
+            case PARSE_TREE_AND:
+            case PARSE_TREE_OR:
+                compile_node(prog, tree->left);
+                jump = emit(prog, tree->type == PARSE_TREE_AND ? OP_JUMP_IF_FAILURE : OP_JUMP_IF_SUCCESS);
+                prog->code[jump].target = pending;
+                pending = jump;
+                right = tree->right;
+                break;
+            case PARSE_TREE_BACKGROUND:
+                compile_child(prog, OP_BACKGROUND, tree->left);
+                right = tree->right;
+                break;
+            case PARSE_TREE_COMMAND:
+            case PARSE_TREE_PIPE:
+                compile_pipeline(prog, tree);
+                break;
+            case PARSE_TREE_ERROR:
+                emit_command(prog, OP_ERROR, tree);
+                break;
+            case PARSE_TREE_NONE:
+                break;
+        }
+        tree = right;
+    }
+
+    while (pending != NO_JUMP) {
+        size_t next = prog->code[pending].target;
+        patch_target(prog, pending);
+        pending = next;
+    }
+}
+
+program *compile_tree(parse_tree *tree) {
+    program *prog = init_program();
+    compile_node(prog, tree);
+    emit(prog, OP_EXIT);
+    prog->release = release_tree;
+    prog->source = tree;
+    return prog;
+}
+
+static const char *opcode_names[] = {
+    [OP_SPAWN] = "spawn",
+    [OP_PIPE] = "pipe",
+    [OP_WAIT] = "wait",
+    [OP_JUMP_IF_SUCCESS] = "jump-if-success",
+    [OP_JUMP_IF_FAILURE] = "jump-if-failure",
+    [OP_BACKGROUND] = "background",
+    [OP_SUBSHELL] = "subshell",
+    [OP_ERROR] = "error",
+    [OP_EXIT] = "exit"
+};
+
+void print_program(program *program) {
+    for (size_t pc = 0; pc < program->length; pc++) {
+        instruction *inst = &program->code[pc];
+        printf("%4zu  %s", pc, opcode_names[inst->op]);
+        switch (inst->op) {
+            case OP_SPAWN:
+            case OP_ERROR:
+                for (size_t i = 0; i < inst->command->argc; i++) {
+                    printf(" %s", inst->command->argv[i]);
+                }
+                break;
+            case OP_JUMP_IF_SUCCESS:
+            case OP_JUMP_IF_FAILURE:
+            case OP_BACKGROUND:
+            case OP_SUBSHELL:
+                printf(" %zu", inst->target);
+                break;
+            default:
+                break;
+        }
+        printf("\n");
+    }
+}
+
+// Quotes the word if it couldn't be typed as is
+static void describe_word(const char *word, string_buffer *out) {
+    size_t length = strlen(word);
+    if (length > 0 && scan_word(word, length) == length) {
+        push_string(out, word, length);
+        return;
+    }
+    push_string(out, "\"", 1);
+    for (; *word; word++) {
+        if (*word == CHAR_QUOTE || *word == CHAR_ESCAPE) {
+            push_string(out, "\\", 1);
+        }
+        push_string(out, word, 1);
+    }
+    push_string(out, "\"", 1);
+}
+
+static void describe_command(parse_tree *command, string_buffer *out) {
+    for (size_t i = 0; i < command->argc; i++) {
+        if (i > 0) {
+            push_string(out, " ", 1);
+        }
+        describe_word(command->argv[i], out);
+    }
+    for (size_t i = 0; i < command->redirection_count; i++) {
+        redir_info *redirection = &command->redirections[i];
+        push_string(out, redirection->type == REDIR_OUT ? " > " : " < ", 3);
+        describe_word(redirection->target_filename, out);
+    }
+}
+
+void describe_code(program *program, size_t start, size_t end, string_buffer *out) {
+    const char *separator = NULL;
+    size_t pipes = 0;
+    size_t pc = start;
+    while (pc < end) {
+        instruction *inst = &program->code[pc++];
+        switch (inst->op) {
+            case OP_PIPE:
+                pipes++;
+                continue;
+            case OP_WAIT:
+                separator = "; ";
+                continue;
+            case OP_JUMP_IF_SUCCESS:
+                separator = " || ";
+                continue;
+            case OP_JUMP_IF_FAILURE:
+                separator = " && ";
+                continue;
+            case OP_ERROR:
+            case OP_EXIT:
+                continue;
+            default:
+                break;
+        }
+
+        if (separator && string_buffer_length(out) > 0) {
+            push_string(out, separator, strlen(separator));
+        }
+        if (inst->op == OP_SPAWN) {
+            describe_command(inst->command, out);
+        } else if (inst->op == OP_SUBSHELL) {
+            push_string(out, "(", 1);
+            describe_code(program, pc, inst->target - 1, out);
+            push_string(out, ")", 1);
+            pc = inst->target;
+        } else {
+            describe_code(program, pc, inst->target - 1, out);
+            push_string(out, " &", 2);
+            pc = inst->target;
+            separator = " ";
+            continue;
+        }
+
+        // The pipe opened before a stage connects it to the next one
+        if (pipes > 0) {
+            pipes--;
+            separator = " | ";
+        } else {
+            separator = NULL;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "parser.h"
+#include "util.h"
+
+
+// A parse tree lowered to a flat sequence of instructions. Control flow is
+// expressed with jumps, so running a program never has to walk the tree.
+//
+// Processes are started with the stdin and stdout left by the previous OP_PIPE
+// and collected by the next OP_WAIT. Forking instructions continue in the child
+// at the following instruction, which runs until it reaches an OP_EXIT.
+
+enum opcode {
+    OP_SPAWN,           // Run command, either in process or as a child process
+    OP_PIPE,            // Connect the next process started to the one after it
+    OP_WAIT,            // Wait for every process started since the last wait
+    OP_JUMP_IF_SUCCESS, // Jump to target if the last status was zero
+    OP_JUMP_IF_FAILURE, // Jump to target if the last status was nonzero
+    OP_BACKGROUND,      // Fork a child that is never waited on; parent jumps to target
+    OP_SUBSHELL,        // Fork a child collected like a command; parent jumps to target
+    OP_ERROR,           // Report an error tree and fail
+    OP_EXIT             // End the program, or the child process running it
+};
+typedef enum opcode opcode;
+
+struct instruction {
+    opcode op;
+    union {
+        parse_tree *command; // OP_SPAWN, OP_ERROR
+        size_t target;       // Jumps and forks
+    };
+};
+typedef struct instruction instruction;
+
+// Programs refer to the commands of the tree they were compiled from, or the
+// cache they were loaded from, and own it. Queued jobs that will run part of a
+// program hold references to it, and it is only released with the last one.
+struct program {
+    instruction *code;
+    size_t length;
+    size_t capacity;
+
+    size_t references;
+    void (*release)(void *source);
+    void *source;
+};
+typedef struct program program;
+
+
+// The program takes the tree, which is freed along with it
+program *compile_tree(parse_tree *tree);
+
+program *hold_program(program *program);
+
+// Drops a reference to the program
+void free_program(program *program);
+
+void print_program(program *program);
+
+// Appends shell-like text for the code in [start, end) to out, to name jobs by.
+// It is rebuilt from the instructions, so parentheses that only grouped lists
+// are lost.
+void describe_code(program *program, size_t start, size_t end, string_buffer *out);
@@ -0,0 +1,141 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+#include "tokens.h"
+
+
+const uint8_t char_class[256] = {
+    ['0' ... '9'] = CLASS_WORD,
+    ['A' ... 'Z'] = CLASS_WORD,
+    ['a' ... 'z'] = CLASS_WORD,
+    ['.'] = CLASS_WORD, [','] = CLASS_WORD, ['/'] = CLASS_WORD,
+    ['!'] = CLASS_WORD, ['@'] = CLASS_WORD, ['#'] = CLASS_WORD,
+    ['$'] = CLASS_WORD, ['%'] = CLASS_WORD, ['^'] = CLASS_WORD,
+    ['*'] = CLASS_WORD, ['-'] = CLASS_WORD, ['_'] = CLASS_WORD,
+    ['+'] = CLASS_WORD, ['='] = CLASS_WORD, ['~'] = CLASS_WORD,
+    ['['] = CLASS_WORD, [']'] = CLASS_WORD,
+
+    [CHAR_SPACE] = CLASS_BLANK,
+    [CHAR_TAB] = CLASS_BLANK,
+
+    [CHAR_AND] = CLASS_OPERATOR,
+    [CHAR_OR] = CLASS_OPERATOR,
+    [CHAR_OUT] = CLASS_OPERATOR,
+    [CHAR_IN] = CLASS_OPERATOR,
+    [CHAR_ENDSTMT] = CLASS_OPERATOR,
+    [CHAR_SUBSHELL_OPEN] = CLASS_OPERATOR,
+    [CHAR_SUBSHELL_CLOSE] = CLASS_OPERATOR,
+    [CHAR_NEWLINE] = CLASS_OPERATOR,
+
+    [CHAR_QUOTE] = CLASS_QUOTE,
+    [CHAR_ESCAPE] = CLASS_ESCAPE,
+};
+
+
+static size_t scan_while(const char *input, size_t length, uint8_t classes) {
+    size_t i = 0;
+    while (i < length && (classify(input[i]) & classes)) {
+        i++;
+    }
+    return i;
+}
+
+static size_t scan_until(const char *input, size_t length, uint8_t classes) {
+    size_t i = 0;
+    while (i < length && !(classify(input[i]) & classes)) {
+        i++;
+    }
+    return i;
+}
+
+// The vector kernels build a mask of the bytes that end the run and stop at the
+// first set bit. Bytes >= 0x80 compare as negative, which keeps them out of
+// every word range below.
+
+#if defined(__AVX2__)
+
+#define VECTOR_WIDTH 32
+typedef __m256i vector;
+
+#define vload(p) _mm256_loadu_si256((const __m256i *) (p))
+#define vset(c) _mm256_set1_epi8(c)
+#define veq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vgt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vand(a, b) _mm256_and_si256(a, b)
+#define vor(a, b) _mm256_or_si256(a, b)
+#define vmask(v) ((uint32_t) _mm256_movemask_epi8(v))
+
+#elif defined(__SSE2__)
+
+#define VECTOR_WIDTH 16
+typedef __m128i vector;
+
+#define vload(p) _mm_loadu_si128((const __m128i *) (p))
+#define vset(c) _mm_set1_epi8(c)
+#define veq(a, b) _mm_cmpeq_epi8(a, b)
+#define vgt(a, b) _mm_cmpgt_epi8(a, b)
+#define vand(a, b) _mm_and_si128(a, b)
+#define vor(a, b) _mm_or_si128(a, b)
+#define vmask(v) ((uint32_t) _mm_movemask_epi8(v))
+
+#endif
+
+#ifdef VECTOR_WIDTH
+
+#define FULL_MASK ((uint32_t) ((1ULL << VECTOR_WIDTH) - 1))
+
+static inline vector in_range(vector v, char lo, char hi) {
+    return vand(vgt(v, vset(lo - 1)), vgt(vset(hi + 1), v));
+}
+
+// Mirrors the CLASS_WORD entries of char_class
+static inline uint32_t word_mask(vector v) {
+    vector word = vor(veq(v, vset('!')), veq(v, vset('=')));
+    word = vor(word, veq(v, vset('~')));
+    word = vor(word, in_range(v, '#', '%'));   // # $ %
+    word = vor(word, in_range(v, '*', '9'));   // * + , - . / and digits
+    word = vor(word, in_range(v, '@', '['));   // @, upper case and [
+    word = vor(word, in_range(v, ']', '_'));   // ] ^ _
+    word = vor(word, in_range(v, 'a', 'z'));
+    return vmask(word);
+}
+
+static inline uint32_t blank_mask(vector v) {
+    return vmask(vor(veq(v, vset(CHAR_SPACE)), veq(v, vset(CHAR_TAB))));
+}
+
+static inline uint32_t plain_quoted_mask(vector v) {
+    vector special = vor(veq(v, vset(CHAR_QUOTE)), veq(v, vset(CHAR_ESCAPE)));
+    return ~vmask(special) & FULL_MASK;
+}
+
+#define DEFINE_SCANNER(name, mask_fn, tail_fn, classes)                     \
+    size_t name(const char *input, size_t length) {                         \
+        size_t i = 0;                                                       \
+        while (i + VECTOR_WIDTH <= length) {                                \
+            uint32_t stop = ~mask_fn(vload(input + i)) & FULL_MASK;         \
+            if (stop) {                                                     \
+                return i + __builtin_ctz(stop);                             \
+            }                                                               \
+            i += VECTOR_WIDTH;                                              \
+        }                                                                   \
+        return i + tail_fn(input + i, length - i, classes);                 \
+    }
+
+#else
+
+#define DEFINE_SCANNER(name, mask_fn, tail_fn, classes)                     \
+    size_t name(const char *input, size_t length) {                         \
+        return tail_fn(input, length, classes);                             \
+    }
+
+#endif
+
+DEFINE_SCANNER(scan_word, word_mask, scan_while, CLASS_WORD)
+DEFINE_SCANNER(scan_blank, blank_mask, scan_while, CLASS_BLANK)
+DEFINE_SCANNER(scan_quoted, plain_quoted_mask, scan_until, CLASS_QUOTE | CLASS_ESCAPE)
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Character classes for the lexer
+#define CLASS_WORD     0x01 // May appear unquoted in a word
+#define CLASS_BLANK    0x02 // Separates tokens without being one
+#define CLASS_OPERATOR 0x04 // Starts an operator token (newline included)
+#define CLASS_QUOTE    0x08
+#define CLASS_ESCAPE   0x10
+
+extern const uint8_t char_class[256];
+
+static inline uint8_t classify(char c) {
+    return char_class[(unsigned char) c];
+}
+
+// Each scanner returns the length of the longest prefix of input made up of
+// the given kind of byte, never looking past length bytes
+
+size_t scan_word(const char *input, size_t length);
+size_t scan_blank(const char *input, size_t length);
+
+// Length of the prefix containing neither a quote nor an escape
+size_t scan_quoted(const char *input, size_t length);
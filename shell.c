@@ -1,103 +1,435 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "cache.h"
 #include "exec.h"
 #include "input.h"
+#include "jobs.h"
+#include "mux.h"
+#include "parallel.h"
 #include "parser.h"
+#include "stats.h"
 #include "tokens.h"
+#include "trace.h"
 #include "util.h"
 
-void do_command(char *command) {
-    lexer_token_list *token_list = init_token_list();
-    lexer_context *lexer = init_lexer(command);
-    lexer_token *token = next_token(lexer);
-    while (token) {
-        add_token(token_list, token);
-        token = next_token(lexer);
+// Threads used to lex and parse scripts; 1 parses on the main thread as it reads
+static size_t parse_threads = 1;
+
+// Status of the last command run, which the shell exits with
+static int last_status = 0;
+
+// Runs a freshly parsed tree and frees it. Returns false if it is an error. If
+// exits is set, nothing runs after it, so its last command may replace the shell.
+static bool run_tree(parse_tree *tree, bool exits) {
+    bool parsed = tree->type != PARSE_TREE_ERROR;
+    if (!parsed) {
+        fprintf(stderr, "%s\n", tree->argv[0]);
+    } else if (tree->type != PARSE_TREE_NONE) {
+        // The tree goes with the program it's compiled to
+        last_status = exec_tree(tree, exits);
+        return parsed;
     }
-    free_lexer(lexer);
-    parse_tree *tree = parse(token_list);
-    if (tree) {
-        if (tree->type == PARSE_TREE_ERROR) {
-            fprintf(stderr, "%s\n", tree->argv[0]);
-        } else if (tree->type != PARSE_TREE_NONE) {
-            exec_tree(tree);
-        }
-        free_parse_tree(tree);
+    free_parse_tree(tree);
+    return parsed;
+}
+
+// Parses and runs a lexed command, or reports the error that stopped lexing it.
+// Returns false if the command couldn't be lexed or parsed.
+static bool run_tokens(lexer_token_list *tokens, lexer_token *error, bool exits) {
+    if (error) {
+        fprintf(stderr, "%s\n", get_token_value(error));
+        return false;
     }
+    return run_tree(parse(tokens), exits);
+}
+
+// Runs the first length bytes of command, which are decoded in place but stay
+// owned by the caller. Returns false if the command couldn't be lexed or parsed.
+bool do_command(char *command, size_t length, bool exits) {
+    lexer_token_list *token_list = init_token_list();
+    lexer_context *lexer = init_lexer_borrowed(command, length);
+    bool parsed = run_tokens(token_list, lex_tokens(lexer, token_list), exits);
     free_token_list(token_list);
+    free_lexer(lexer);
+    return parsed;
+}
+
+// Reports jobs that finish while the shell waits for a command to be typed
+static bool notify_jobs(void) {
+    if (!update_jobs()) {
+        return false;
+    }
+    fputs("\n", stdout);
+    fflush(stdout);
+    sync_output_mux();
+    report_finished_jobs(STDERR_FILENO);
+    return true;
 }
 
-// Main interactive mode loop
+// Main interactive mode loop, which also runs commands piped to stdin. Each
+// line is lexed as it is read, and the lexer decides when a command is complete.
+// On a terminal, finished jobs are reported as soon as they finish.
 static void repl(void) {
-    char input[1024];
+    input_reader *reader = init_input_reader(STDIN_FILENO);
+    string_buffer *input_buffer = init_string_buffer();
+    bool interactive = isatty(STDIN_FILENO);
+    if (interactive) {
+        set_jobs_interactive(true);
+        watch_while_reading(reader, jobs_event_fd(), notify_jobs);
+    }
     bool run = true;
     while (run) {
-        string_buffer *input_buffer = init_string_buffer();
-        input_line *line = NULL;
-        bool more = false;
-        
+        if (interactive && update_jobs()) {
+            sync_output_mux();
+            report_finished_jobs(STDERR_FILENO);
+        }
+        lexer_token_list *token_list = init_token_list();
+        lexer_context *lexer = init_lexer_resumable();
+        lexer_token *error = NULL;
+        char *prompt = "$ ";
+
         do {
-            char *prompt = line == NULL ? "$ " : "> ";
-            line = get_line(stdin, prompt);
+            input_line *line = get_line(reader, prompt);
             if (line == NULL) {
                 run = false;
-                break;
+                lexer_finish(lexer);
+            } else {
+                push_string(input_buffer, line_content(line), line_length(line));
             }
-            push_string(input_buffer, line_content(line));
-            more = line_hasmore(line);
-            free_input_line(line);
-        } while(more);
-        
-        char *raw_input = build_string(input_buffer);
+            lexer_feed(lexer, string_buffer_contents(input_buffer), string_buffer_length(input_buffer));
+            error = lex_tokens(lexer, token_list);
+            prompt = "> ";
+        } while (!error && lexer_needs_input(lexer));
+
+        run_tokens(token_list, error, false);
+        free_token_list(token_list);
+        free_lexer(lexer);
+        reset_string_buffer(input_buffer);
+    }
+    free_string_buffer(input_buffer);
+    free_input_reader(reader);
+}
 
-        do_command(raw_input);
+#define SCRIPT_CHUNK_SIZE (64 * 1024)
 
-        free_string_buffer(input_buffer);
-        free(raw_input);
+// Input gathered per thread before a script is parsed in parallel
+#define PARALLEL_BATCH_SIZE (4 * 1024 * 1024)
+
+// Runs the first length bytes of buffer, taking ownership of it
+static bool run_script_buffer(char *buffer, size_t length, bool exits) {
+    buffer[length] = '\0';
+    bool parsed;
+    if (parse_threads > 1) {
+        parsed = run_tree(parse_parallel(buffer, length, parse_threads), exits);
+    } else {
+        parsed = do_command(buffer, length, exits);
     }
+    free(buffer);
+    return parsed;
 }
 
+// Runs a script file from its cached program, parsing, compiling and caching
+// it first on a miss. Returns false without running anything if the script
+// can't be cached or doesn't parse, in which case it should be streamed so
+// that everything before the error still runs.
+static bool run_cached_script(char *filename, int fd) {
+    script_cache *cache = open_script_cache(filename, fd);
+    if (!cache) {
+        return false;
+    }
+
+    program *program = load_cached_program(cache);
+    if (!program) {
+        size_t length;
+        char *source = copy_script_source(cache, &length);
+        parse_tree *tree = parse_parallel(source, length, parse_threads);
+        free(source);
+        if (tree->type == PARSE_TREE_ERROR) {
+            free_parse_tree(tree);
+            close_script_cache(cache);
+            return false;
+        }
+        program = compile_tree(tree);
+        save_cached_program(cache, program);
+        close_script_cache(cache);
+    }
+    last_status = exec_program(program, true);
+    free_program(program);
+    return true;
+}
+
+// Streams a script, running each complete top-level list item as soon as it
+// has been read. Works on pipes and terminals as well as regular files, and
+// only ever holds the items of one chunk in memory. When parsing in parallel,
+// a larger batch is gathered first so each thread has enough to work on.
 static void script(char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Unable to open script file\n");
-        exit(1);
+    int fd = STDIN_FILENO;
+    if (strcmp(filename, "-") != 0) {
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "Unable to open script file\n");
+            exit(1);
+        }
+        if (run_cached_script(filename, fd)) {
+            close(fd);
+            return;
+        }
+        lseek(fd, 0, SEEK_SET);
     }
 
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char *contents = malloc(sizeof(char) * size + 1);
-    size_t read_size = fread(contents, size, 1, file);
-    fclose(file);
-    contents[size] = '\0';
+    size_t batch_size = parse_threads > 1 ? PARALLEL_BATCH_SIZE * parse_threads : 0;
+    size_t capacity = batch_size + SCRIPT_CHUNK_SIZE;
+    size_t length = 0;
+    char *buffer = malloc(sizeof(char) * capacity + 1);
+
+    while (1) {
+        if (capacity - length < SCRIPT_CHUNK_SIZE / 2) {
+            // A single item larger than what's buffered so far
+            capacity = capacity * 2;
+            buffer = realloc(buffer, sizeof(char) * capacity + 1);
+        }
+        ssize_t read_size = read(fd, buffer + length, capacity - length);
+        if (read_size == -1 && errno == EINTR) {
+            continue;
+        }
+        if (read_size == -1) {
+            fprintf(stderr, "Error reading script file\n");
+            free(buffer);
+            exit(1);
+        }
+        if (read_size == 0) {
+            break;
+        }
+        length += read_size;
+        if (length < batch_size) {
+            continue;
+        }
+
+        size_t boundary = find_list_boundary(buffer, length);
+        if (boundary == 0) {
+            continue;
+        }
 
-    if (!read_size) {
-        fprintf(stderr, "Error reading script file\n");
-        free(contents);
+        // The buffer is handed off whole; the incomplete rest moves to a new one
+        char *rest = malloc(sizeof(char) * capacity + 1);
+        memcpy(rest, buffer + boundary, length - boundary);
+        length = length - boundary;
+        if (!run_script_buffer(buffer, boundary, false)) {
+            free(rest);
+            exit(1);
+        }
+        buffer = rest;
+    }
+
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    if (!run_script_buffer(buffer, length, true)) {
         exit(1);
     }
+}
+
+// A script run by -P, in a child of its own whose output is held until it ends
+struct script_run {
+    char *filename;
+    pid_t pid;
+    int output;
+    int status;
+    struct timespec started;
+    double elapsed;
+    double cpu;
+};
+typedef struct script_run script_run;
+
+static double seconds_between(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double cpu_seconds(const struct rusage *usage) {
+    return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6
+        + usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+// The child runs the script with its stdout and stderr in a temporary file, and
+// stdin from /dev/null, since the scripts can't share it
+static bool start_script(script_run *run) {
+    run->output = open_temporary_file();
+    clock_gettime(CLOCK_MONOTONIC, &run->started);
+    run->pid = run->output == -1 ? -1 : fork();
+    if (run->pid == 0) {
+        int null = open("/dev/null", O_RDONLY);
+        if (null != -1) {
+            dup2(null, STDIN_FILENO);
+            close(null);
+        }
+        dup2(run->output, STDOUT_FILENO);
+        dup2(run->output, STDERR_FILENO);
+        script(run->filename);
+        exit(last_status);
+    }
+    if (run->pid == -1) {
+        perror(run->filename);
+        if (run->output != -1) {
+            close(run->output);
+        }
+        run->status = 127;
+        return false;
+    }
+    trace_spawned(run->pid, "script", run->filename, NULL);
+    return true;
+}
+
+// Reaps the next script to finish and copies out all of its output at once.
+// The scripts are the only children the shell has, so any will do.
+static script_run *finish_script(script_run *runs, size_t count) {
+    while (1) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid == -1 && errno == EINTR) {
+            continue;
+        }
+        if (pid == -1) {
+            return NULL;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            script_run *run = &runs[i];
+            if (run->pid != pid) {
+                continue;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            run->elapsed = seconds_between(&run->started, &now);
+            run->cpu = cpu_seconds(&usage);
+            run->status = exit_status(status);
+            trace_reaped(pid, status, &usage);
+            fflush(stdout);
+            copy_file_contents(run->output, STDOUT_FILENO);
+            close(run->output);
+            return run;
+        }
+    }
+}
+
+// Runs each script in a child of its own, up to workers at once, and ends with
+// every script's status and times. Returns 0 if they all succeeded.
+static int run_scripts(char **filenames, size_t count, size_t workers) {
+    script_run *runs = calloc(count, sizeof(script_run));
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
 
-    do_command(contents);
-    free(contents);
+    fflush(stdout);
+    fflush(stderr);
+    size_t next = 0;
+    size_t running = 0;
+    while (next < count || running > 0) {
+        while (next < count && running < workers) {
+            script_run *run = &runs[next++];
+            run->filename = filenames[next - 1];
+            running += start_script(run);
+        }
+        if (running > 0) {
+            if (!finish_script(runs, next)) {
+                break;
+            }
+            running--;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    size_t failed = 0;
+    double cpu = 0;
+    fprintf(stderr, "%6s %10s %10s  %s\n", "STATUS", "REAL", "CPU", "SCRIPT");
+    for (size_t i = 0; i < count; i++) {
+        script_run *run = &runs[i];
+        failed += run->status != 0;
+        cpu += run->cpu;
+        fprintf(stderr, "%6d %9.3fs %9.3fs  %s\n", run->status, run->elapsed, run->cpu,
+                run->filename);
+    }
+    fprintf(stderr, "%zu scripts, %zu failed, %.3fs real, %.3fs cpu, %zu at once\n",
+            count, failed, seconds_between(&started, &finished), cpu, workers);
+    free(runs);
+    return failed > 0 ? 1 : 0;
 }
 
 static void usage(void) {
-    fprintf(stderr, "Usage: nush [FILE]\n");
+    fprintf(stderr, "Usage: nush [-p THREADS] [-t TRACE] [-c COMMAND | FILE | -P SCRIPTS FILE...]\n");
 }
 
 int main(int argc, char **argv) {
-    if (argc == 1) {
+    char *command = NULL;
+    char *trace_path = NULL;
+    size_t script_workers = 0;
+    bool many_scripts = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:p:P:t:")) != -1) {
+        switch (opt) {
+            case 'c':
+                command = optarg;
+                break;
+            case 'p':
+                parse_threads = strtoul(optarg, NULL, 10);
+                if (parse_threads == 0) {
+                    parse_threads = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            case 'P':
+                // 0 runs as many scripts at once as there are cores
+                script_workers = strtoul(optarg, NULL, 10);
+                if (script_workers == 0) {
+                    script_workers = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                many_scripts = true;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    // Exit handlers run in reverse, so queued jobs are started before their
+    // output is waited for, and the trace and stats are written out last
+    init_tracing(trace_path);
+    init_stats();
+    atexit(close_output_mux);
+    atexit(drain_job_queue);
+
+    if (many_scripts) {
+        if (command || optind == argc) {
+            usage();
+            return 1;
+        }
+        return run_scripts(&argv[optind], argc - optind, script_workers);
+    } else if (command) {
+        if (optind != argc) {
+            usage();
+            return 1;
+        }
+        if (!do_command(command, strlen(command), true)) {
+            return 1;
+        }
+    } else if (optind == argc) {
         repl();
-    } else if (argc == 2) {
-        script(argv[1]);
+    } else if (optind + 1 == argc) {
+        script(argv[optind]);
     } else {
         usage();
+        return 1;
     }
+    return last_status;
 }
@@ -0,0 +1,317 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "stats.h"
+#include "util.h"
+
+
+#define STATS_ENV "NUSH_STATS"
+
+// Each power of two is split into this many buckets, as in an HDR histogram,
+// so a bucket is never more than an eighth wider than the values in it
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+
+struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+typedef struct histogram histogram;
+
+// Lexing and parsing run on the parser's threads too, so their counters are
+// atomic. Everything else is only touched by the thread running commands.
+struct shell_stats {
+    atomic_llong lex_ns;
+    atomic_llong tokens;
+    atomic_llong parse_ns;
+    atomic_llong nodes;
+    atomic_llong allocated;
+
+    long long exec_ns;
+    long long exec_since;
+    size_t exec_depth;
+    long long wait_ns;
+    histogram spawn;
+    histogram wait;
+
+    const char *dump_path;
+    pid_t owner;
+};
+typedef struct shell_stats shell_stats;
+
+static shell_stats stats;
+
+
+long long stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void count_lexing(long long start, size_t tokens) {
+    atomic_fetch_add_explicit(&stats.lex_ns, stats_clock() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.tokens, tokens, memory_order_relaxed);
+}
+
+void count_parsing(long long start, size_t nodes) {
+    atomic_fetch_add_explicit(&stats.parse_ns, stats_clock() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.nodes, nodes, memory_order_relaxed);
+}
+
+void begin_execution(void) {
+    if (stats.exec_depth++ == 0) {
+        stats.exec_since = stats_clock();
+    }
+}
+
+void end_execution(void) {
+    if (--stats.exec_depth == 0) {
+        stats.exec_ns += stats_clock() - stats.exec_since;
+    }
+}
+
+// Including the program still running, which shellstats is part of
+static long long exec_time(void) {
+    return stats.exec_ns + (stats.exec_depth > 0 ? stats_clock() - stats.exec_since : 0);
+}
+
+void count_allocation(size_t bytes) {
+    atomic_fetch_add_explicit(&stats.allocated, bytes, memory_order_relaxed);
+}
+
+
+// Values below SUB_BUCKETS get a bucket each. Above that, the top bit picks a
+// row of buckets and the bits below it pick one bucket in the row.
+static size_t bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int top = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (top - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (top - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// The smallest value that falls in the bucket
+static uint64_t bucket_floor(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int top = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub) << (top - SUB_BUCKET_BITS);
+}
+
+static void record(histogram *histogram, long long start) {
+    long long elapsed = stats_clock() - start;
+    uint64_t value = elapsed > 0 ? elapsed : 0;
+    histogram->counts[bucket_index(value)]++;
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->count++;
+    histogram->total += value;
+}
+
+void record_spawn_latency(long long start) {
+    record(&stats.spawn, start);
+}
+
+void record_wait_latency(long long start) {
+    stats.wait_ns += stats_clock() - start;
+    record(&stats.wait, start);
+}
+
+// The value at or below which the given fraction of the recorded values fall,
+// to within a bucket
+static uint64_t percentile(histogram *histogram, double fraction) {
+    uint64_t rank = fraction * histogram->count;
+    if (rank < fraction * histogram->count || rank == 0) {
+        rank++;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_floor(i);
+            return value < histogram->min ? histogram->min : value;
+        }
+    }
+    return histogram->max;
+}
+
+static double per_second(long long count, long long ns) {
+    return ns > 0 ? count * 1e9 / ns : 0;
+}
+
+
+// Text report
+
+static double milliseconds(long long ns) {
+    return ns / 1e6;
+}
+
+static void print_histogram(FILE *out, const char *name, histogram *histogram, bool buckets) {
+    if (histogram->count == 0) {
+        fprintf(out, "%-8s no commands\n", name);
+        return;
+    }
+    fprintf(out, "%-8s %llu commands, min %.1fus p50 %.1fus p90 %.1fus p99 %.1fus max %.1fus\n",
+            name, (unsigned long long) histogram->count, histogram->min / 1e3,
+            percentile(histogram, 0.5) / 1e3, percentile(histogram, 0.9) / 1e3,
+            percentile(histogram, 0.99) / 1e3, histogram->max / 1e3);
+    for (size_t i = 0; buckets && i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] > 0) {
+            fprintf(out, "    >= %10.1fus  %llu\n", bucket_floor(i) / 1e3,
+                    (unsigned long long) histogram->counts[i]);
+        }
+    }
+}
+
+static void print_stats(FILE *out, bool buckets) {
+    long long lex_ns = atomic_load(&stats.lex_ns);
+    long long tokens = atomic_load(&stats.tokens);
+    fprintf(out, "lex      %10.3fms  %lld tokens, %.0f tokens/s\n", milliseconds(lex_ns),
+            tokens, per_second(tokens, lex_ns));
+    fprintf(out, "parse    %10.3fms  %lld nodes\n", milliseconds(atomic_load(&stats.parse_ns)),
+            (long long) atomic_load(&stats.nodes));
+    long long exec_ns = exec_time();
+    fprintf(out, "exec     %10.3fms  %.3fms waiting, %.3fms in the shell\n",
+            milliseconds(exec_ns), milliseconds(stats.wait_ns),
+            milliseconds(exec_ns - stats.wait_ns));
+    fprintf(out, "alloc    %lld bytes\n", (long long) atomic_load(&stats.allocated));
+    print_histogram(out, "spawn", &stats.spawn, buckets);
+    print_histogram(out, "wait", &stats.wait, buckets);
+}
+
+
+// JSON
+
+static void write_histogram(FILE *out, const char *name, histogram *histogram) {
+    fprintf(out, "  \"%s\": {\"count\": %llu, \"min\": %llu, \"max\": %llu, \"mean\": %.0f, "
+                 "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"buckets\": [",
+            name, (unsigned long long) histogram->count, (unsigned long long) histogram->min,
+            (unsigned long long) histogram->max,
+            histogram->count ? (double) histogram->total / histogram->count : 0.0,
+            (unsigned long long) percentile(histogram, 0.5),
+            (unsigned long long) percentile(histogram, 0.9),
+            (unsigned long long) percentile(histogram, 0.99));
+    bool first = true;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] > 0) {
+            fprintf(out, "%s[%llu, %llu]", first ? "" : ", ",
+                    (unsigned long long) bucket_floor(i), (unsigned long long) histogram->counts[i]);
+            first = false;
+        }
+    }
+    fprintf(out, "]}");
+}
+
+// Times are in nanoseconds, and histogram buckets are [floor, count] pairs
+static void write_stats(FILE *out) {
+    long long lex_ns = atomic_load(&stats.lex_ns);
+    long long tokens = atomic_load(&stats.tokens);
+    fprintf(out, "{\n");
+    fprintf(out, "  \"lex_ns\": %lld,\n  \"tokens\": %lld,\n  \"tokens_per_second\": %.0f,\n",
+            lex_ns, tokens, per_second(tokens, lex_ns));
+    fprintf(out, "  \"parse_ns\": %lld,\n  \"nodes\": %lld,\n",
+            (long long) atomic_load(&stats.parse_ns), (long long) atomic_load(&stats.nodes));
+    long long exec_ns = exec_time();
+    fprintf(out, "  \"exec_ns\": %lld,\n  \"wait_ns\": %lld,\n  \"shell_exec_ns\": %lld,\n",
+            exec_ns, stats.wait_ns, exec_ns - stats.wait_ns);
+    fprintf(out, "  \"allocated_bytes\": %lld,\n", (long long) atomic_load(&stats.allocated));
+    write_histogram(out, "spawn_latency_ns", &stats.spawn);
+    fprintf(out, ",\n");
+    write_histogram(out, "wait_latency_ns", &stats.wait);
+    fprintf(out, "\n}\n");
+}
+
+// Only the shell writes its stats, not the children that inherit them
+static void dump_stats(void) {
+    if (getpid() != stats.owner) {
+        return;
+    }
+    FILE *out = fopen(stats.dump_path, "w");
+    if (!out) {
+        perror(stats.dump_path);
+        return;
+    }
+    write_stats(out);
+    fclose(out);
+}
+
+bool stats_dumping(void) {
+    return stats.dump_path && *stats.dump_path && getpid() == stats.owner;
+}
+
+void init_stats(void) {
+    stats.dump_path = getenv(STATS_ENV);
+    if (stats.dump_path && *stats.dump_path) {
+        stats.owner = getpid();
+        atexit(dump_stats);
+    }
+}
+
+
+static void reset_stats(void) {
+    atomic_store(&stats.lex_ns, 0);
+    atomic_store(&stats.tokens, 0);
+    atomic_store(&stats.parse_ns, 0);
+    atomic_store(&stats.nodes, 0);
+    atomic_store(&stats.allocated, 0);
+    stats.exec_ns = 0;
+    stats.exec_since = stats_clock();
+    stats.wait_ns = 0;
+    memset(&stats.spawn, 0, sizeof(histogram));
+    memset(&stats.wait, 0, sizeof(histogram));
+}
+
+// shellstats prints the counters, with -v every histogram bucket as well, or
+// with -j the JSON written at exit. -r resets them afterwards.
+int shellstats_command(char **argv, int in, int out) {
+    bool buckets = false;
+    bool json = false;
+    bool reset = false;
+    for (size_t i = 1; argv[i]; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            buckets = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            reset = true;
+        } else {
+            fprintf(stderr, "Usage: shellstats [-v | -j] [-r]\n");
+            return 2;
+        }
+    }
+
+    char *text;
+    size_t length;
+    FILE *report = open_memstream(&text, &length);
+    if (json) {
+        write_stats(report);
+    } else {
+        print_stats(report, buckets);
+    }
+    fclose(report);
+    bool written = write_all(out, text, length);
+    free(text);
+    if (reset) {
+        reset_stats();
+    }
+    return written ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Counters for the shell's own overhead: time spent lexing, parsing and
+// executing, how much the lexer and parser produced, and histograms of how
+// long launching a command takes and how long the shell blocks waiting for
+// one. Each costs a couple of clock reads, so they're always on. shellstats
+// shows them, and $NUSH_STATS names a file they're written to as JSON at exit.
+
+// Nanoseconds on the clock the counters use
+long long stats_clock(void);
+
+void count_lexing(long long start, size_t tokens);
+void count_parsing(long long start, size_t nodes);
+void count_allocation(size_t bytes);
+
+// Around running a program. Time spent waiting for commands is counted along
+// with the rest, and also on its own, so the difference is the shell's.
+void begin_execution(void);
+void end_execution(void);
+
+// From just before a command is spawned until it has exec'd
+void record_spawn_latency(long long start);
+// From when the shell starts waiting for a command until it's reaped
+void record_wait_latency(long long start);
+
+// Arranges for the JSON dump at exit if $NUSH_STATS is set
+void init_stats(void);
+// Whether this process writes the dump at exit, and so mustn't be replaced
+bool stats_dumping(void);
+
+// The shellstats builtin
+int shellstats_command(char **argv, int in, int out);
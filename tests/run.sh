@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs every tests/test_*.sh against the shell given as the first argument.
+# Each test exits non-zero and says why when it fails.
+
+bin=$(realpath "$1")
+dir=$(dirname "$0")
+failed=0
+
+for test in "$dir"/test_*.sh; do
+    name=$(basename "$test" .sh)
+    if NUSH="$bin" sh "$test"; then
+        echo "PASS $name"
+    else
+        echo "FAIL $name"
+        failed=1
+    fi
+done
+
+exit $failed
@@ -0,0 +1,19 @@
+#!/bin/sh
+# A line ending in a lone & is complete, so a streamed script runs it without
+# waiting for the next line to arrive
+
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+
+{ printf 'echo first &\n'; sleep 2; printf 'echo second\n'; } | "$NUSH" - > "$out" &
+sleep 1
+if ! grep -qx first "$out"; then
+    echo "background command waited for the next line"
+    exit 1
+fi
+wait
+
+if [ "$(cat "$out")" != "$(printf 'first\nsecond')" ]; then
+    echo "unexpected output: $(cat "$out")"
+    exit 1
+fi
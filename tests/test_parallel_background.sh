@@ -0,0 +1,24 @@
+#!/bin/sh
+# A script split for parsing in parallel can be cut right after a line ending
+# in &, and every background job in it must still run
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk 'BEGIN {
+    pad = sprintf("%0500d", 0)
+    for (i = 0; i < 400; i++) print "echo " i " " pad " &"
+    print "echo " i " " pad " && echo and &"
+    print "wait"
+}' > "$dir/script"
+
+"$NUSH" "$dir/script" | sort > "$dir/serial"
+"$NUSH" -p 4 "$dir/script" | sort > "$dir/parallel"
+if [ "$(wc -l < "$dir/serial")" -ne 402 ]; then
+    echo "serial run printed $(wc -l < "$dir/serial") lines"
+    exit 1
+fi
+if ! cmp -s "$dir/serial" "$dir/parallel"; then
+    echo "parallel run printed $(wc -l < "$dir/parallel") lines, not 402"
+    exit 1
+fi
@@ -0,0 +1,32 @@
+#!/bin/sh
+# The printf builtin formats like the C library, and rejects conversions too
+# long to fit its spec buffer instead of overrunning it
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+expect() {
+    name=$1
+    expected=$2
+    printf '%s\n' "$3" > "$dir/script"
+    out=$("$NUSH" "$dir/script" 2>&1)
+    if [ "$out" != "$expected" ]; then
+        echo "$name: expected '$expected', got '$out'"
+        exit 1
+    fi
+}
+
+expect "conversions" "[   ab][7   ][ff][%]" 'printf "[%5s][%-4d][%.2x][%%]" ab 7 255'
+expect "star width and precision" "[  007]" 'printf "[%*.*d]" 5 3 7'
+expect "negative star width" "[42      ]" 'printf "[%*.*d]" -8 -3 42'
+expect "many flags" "[+2      ]" 'printf "[%-+0#-+08.*d]" -2000000000 2'
+expect "reused format" "a=1 b=2 " 'printf "%s=%d " a 1 b 2'
+
+zeros=$(printf '%039d' 0)
+printf 'printf "%%%s.*d" -2000000000 2\n' "$zeros" > "$dir/script"
+out=$("$NUSH" "$dir/script" 2>&1)
+status=$?
+if [ $status -ne 1 ] || ! echo "$out" | grep -q "conversion too long"; then
+    echo "long conversion: exited $status with '$out'"
+    exit 1
+fi
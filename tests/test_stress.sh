@@ -0,0 +1,28 @@
+#!/bin/sh
+# Long scripts, long chains and deeply nested parentheses are parsed, run and
+# freed without recursing, so they run on a stack far smaller than their size
+# would need otherwise
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+check() {
+    name=$1
+    shift
+    out=$( (ulimit -s 256; "$NUSH" "$@") 2>&1)
+    status=$?
+    if [ $status -ne 0 ] || [ "$out" != done ]; then
+        echo "$name: exited $status with: $(echo "$out" | head -c 200)"
+        exit 1
+    fi
+}
+
+awk 'BEGIN { for (i = 0; i < 1000000; i++) print "true"; print "echo done" }' > "$dir/lines"
+check "million lines" "$dir/lines"
+check "million lines in parallel" -p 4 "$dir/lines"
+
+awk 'BEGIN { for (i = 0; i < 1000000; i++) printf "true && "; print "echo done" }' > "$dir/chain"
+check "million command chain" "$dir/chain"
+
+awk 'BEGIN { for (i = 0; i < 1000000; i++) printf "("; printf "echo done"; for (i = 0; i < 1000000; i++) printf ")"; print "" }' > "$dir/nested"
+check "million nested parentheses" "$dir/nested"
@@ -0,0 +1,19 @@
+#!/bin/sh
+# A script's finished jobs are dropped once they're reaped, but wait still
+# finds a process's status by its pid
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf 'echo $$ > %s/pid\nexit 3\n' "$dir" > "$dir/child.sh"
+{
+    echo "/bin/sh $dir/child.sh &"
+    sleep 1
+    echo "wait $(cat "$dir/pid")"
+} | "$NUSH" - > "$dir/out" 2>&1
+status=$?
+
+if [ "$status" != 3 ]; then
+    echo "wait gave status $status for a reaped job: $(cat "$dir/out")"
+    exit 1
+fi
@@ -1,20 +1,61 @@
-#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "scan.h"
+#include "stats.h"
 #include "tokens.h"
 
 
-struct lexer_context {
-    char *input_buffer;
-    char *position;
-};
-
 struct lexer_token {
     token_type type;
-    char *value;
+    lexer_context *source; // Lexer owning the buffer the span points into
+    size_t offset;
+    size_t length;
+};
+
+#define TOKEN_BLOCK_SIZE 1024
+
+// Tokens are carved out of fixed-size blocks owned by the lexer, so handing one
+// out never costs an allocation of its own and its address stays stable
+struct token_block {
+    struct token_block *next;
+    size_t used;
+    lexer_token tokens[TOKEN_BLOCK_SIZE];
+};
+typedef struct token_block token_block;
+
+enum lexer_state {
+    LEXER_BETWEEN_TOKENS,
+    LEXER_IN_WORD,
+    LEXER_IN_QUOTE
+};
+typedef enum lexer_state lexer_state;
+
+struct lexer_context {
+    char *input_buffer;
+    size_t length;
+    size_t position;
+    bool owns_input;
+
+    // Set once the lexer produces an error token; lexing stops there
+    const char *error;
+
+    // Unless the input is final, a word that runs into the end of it is
+    // suspended, along with where its decoded text ends, and picked up again
+    // once more input has been fed
+    bool final;
+    lexer_state state;
+    size_t token_start;
+    size_t token_end;
+
+    // What the tokens so far leave open, to tell whether a command is complete
+    size_t depth;       // Unclosed parentheses
+    bool continues;     // Last token needs another after it
+    bool at_line_end;   // Last token was a newline
+
+    token_block *blocks;
 };
 
 #define TOKEN_LIST_INITIAL_CAPACITY 256
@@ -23,224 +64,473 @@ struct lexer_token_list {
     lexer_token **contents;
     size_t capacity;
     size_t size;
+    size_t cursor; // Index of the next token to be consumed
 };
 
 
+// Takes ownership of input, which must be heap-allocated. Escapes are decoded
+// in place, so every token value is a span into this one buffer.
 lexer_context *init_lexer(char *input) {
-    char *input_buffer = malloc(sizeof(char) * (strlen(input) + 1));
-    strcpy(input_buffer, input);
+    lexer_context *context = init_lexer_borrowed(input, strlen(input));
+    context->owns_input = true;
+    return context;
+}
 
+// Lexes length bytes of a buffer that stays owned by the caller. The span is
+// still decoded in place, so it must not be shared with another lexer.
+lexer_context *init_lexer_borrowed(char *input, size_t length) {
     lexer_context *context = malloc(sizeof(lexer_context));
-    context->input_buffer = input_buffer;
-    context->position = context->input_buffer;
+    context->input_buffer = input;
+    context->length = length;
+    context->position = 0;
+    context->owns_input = false;
+    context->error = NULL;
+    context->final = true;
+    context->state = LEXER_BETWEEN_TOKENS;
+    context->token_start = 0;
+    context->token_end = 0;
+    context->depth = 0;
+    context->continues = false;
+    context->at_line_end = true;
+    context->blocks = NULL;
 
     return context;
 }
 
-void free_lexer(lexer_context *lexer) {
-    free(lexer->input_buffer);
-    // lexer->position should point to the same allocation of memory
+// Starts a lexer for input that arrives piece by piece, such as a command typed
+// over several lines. Each piece is lexed once, as it is fed.
+lexer_context *init_lexer_resumable(void) {
+    lexer_context *context = init_lexer_borrowed(NULL, 0);
+    context->final = false;
+    return context;
+}
+
+// Gives the lexer a buffer holding everything fed so far followed by new input.
+// The buffer may have moved, but the bytes already fed must be left as the
+// lexer left them, since they have been decoded in place.
+void lexer_feed(lexer_context *context, char *input, size_t length) {
+    context->input_buffer = input;
+    context->length = length;
+}
 
+// No more input will be fed, so whatever is suspended has to be finished
+void lexer_finish(lexer_context *context) {
+    context->final = true;
+}
+
+// Whether the input so far stops short of the end of a command, because of an
+// unterminated quote, an escaped newline, an open parenthesis or a trailing
+// operator
+bool lexer_needs_input(lexer_context *context) {
+    if (context->final || context->error) {
+        return false;
+    }
+    return context->state != LEXER_BETWEEN_TOKENS ||
+           context->position < context->length ||
+           context->depth > 0 ||
+           context->continues ||
+           !context->at_line_end;
+}
+
+// Tokens produced by the lexer point into its buffer, so this must only be
+// called once they are no longer in use
+void free_lexer(lexer_context *lexer) {
+    token_block *block = lexer->blocks;
+    while (block) {
+        token_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    if (lexer->owns_input) {
+        free(lexer->input_buffer);
+    }
     free(lexer);
 }
 
 
-static lexer_token *build_token(token_type type, char *value) {
-    char *token_value = malloc(sizeof(char) * (strlen(value) + 1));
-    lexer_token *token = malloc(sizeof(lexer_token));
-    strcpy(token_value, value);
+static lexer_token *build_token(lexer_context *context, token_type type, size_t start) {
+    token_block *block = context->blocks;
+    if (!block || block->used == TOKEN_BLOCK_SIZE) {
+        block = malloc(sizeof(token_block));
+        count_allocation(sizeof(token_block));
+        block->next = context->blocks;
+        block->used = 0;
+        context->blocks = block;
+    }
+
+    switch (type) {
+        case TOKEN_NEWLINE:
+        case TOKEN_ERROR:
+            break;
+        case TOKEN_AND:
+        case TOKEN_OR:
+        case TOKEN_PIPE:
+        case TOKEN_REDIR_IN:
+        case TOKEN_REDIR_OUT:
+            context->continues = true;
+            break;
+        case TOKEN_SUBSHELL_OPEN:
+            context->depth++;
+            context->continues = true;
+            break;
+        case TOKEN_SUBSHELL_CLOSE:
+            if (context->depth > 0) {
+                context->depth--;
+            }
+            context->continues = false;
+            break;
+        default:
+            context->continues = false;
+            break;
+    }
+    context->at_line_end = type == TOKEN_NEWLINE;
 
+    lexer_token *token = &block->tokens[block->used++];
     token->type = type;
-    token->value = token_value;
+    token->source = context;
+    token->offset = start;
+    token->length = context->position - start;
+    return token;
+}
+
+static lexer_token *error_token(lexer_context *context, const char *message) {
+    context->error = message;
+    context->position = context->length;
+    lexer_token *token = build_token(context, TOKEN_ERROR, context->position);
+    token->length = strlen(message);
     return token;
 }
 
+// Token values are not null-terminated; use get_token_length for their size
 char *get_token_value(lexer_token *token) {
-    return token->value;
+    if (token->type == TOKEN_ERROR) {
+        return (char *) token->source->error;
+    }
+    return token->source->input_buffer + token->offset;
 }
 
-token_type get_token_type(lexer_token *token) {
-    return token->type;
+size_t get_token_length(lexer_token *token) {
+    return token->length;
 }
 
-void free_token(lexer_token *token) {
-    free(token->value);
-    free(token);
+token_type get_token_type(lexer_token *token) {
+    return token->type;
 }
 
 static char peek(lexer_context *context) {
-    return *(context->position);
+    if (context->position >= context->length) {
+        return 0;
+    }
+    return context->input_buffer[context->position];
 }
 
 static char accept(lexer_context *context) {
-    char val = *(context->position);
+    char val = peek(context);
     if (val != 0) context->position++;
     return val;
 }
 
-static bool is_word_char(char c) {
-    return (c != 0) && (isalnum(c) || (strchr(".,/!@#$%^*-_+=~", c) != NULL));
+// Moves a run of n plain bytes at the read cursor down to the write cursor
+static void accept_run(lexer_context *context, char **out, size_t n) {
+    char *in = context->input_buffer + context->position;
+    if (*out != in) {
+        memmove(*out, in, n);
+    }
+    *out += n;
+    context->position += n;
 }
 
-static lexer_token *make_quoteword(lexer_context *context) {
-    char word_buffer[4096];
-    int i = 0;
-    accept(context);
+static size_t remaining(lexer_context *context) {
+    return context->length - context->position;
+}
+
+static char *cursor(lexer_context *context) {
+    return context->input_buffer + context->position;
+}
+
+// Saves a word cut off by the end of the input. The read cursor is left on the
+// first byte not yet decoded.
+static lexer_token *suspend_word(lexer_context *context, lexer_state state, size_t start, char *out) {
+    context->state = state;
+    context->token_start = start;
+    context->token_end = out - context->input_buffer;
+    return NULL;
+}
+
+// Whether the rest of the input is too short to tell what it holds yet
+static bool cut_off(lexer_context *context, size_t needed) {
+    return !context->final && remaining(context) < needed;
+}
+
+// Words are decoded in place: the decoded text never outgrows the raw text, so
+// the write cursor can trail the read cursor within the token's own span
+static lexer_token *lex_quoteword(lexer_context *context, size_t start, char *out) {
     while (1) {
+        accept_run(context, &out, scan_quoted(cursor(context), remaining(context)));
         char next = peek(context);
-        if (next == CHAR_ESCAPE) {
+        if (cut_off(context, next == CHAR_ESCAPE ? 2 : 1)) {
+            return suspend_word(context, LEXER_IN_QUOTE, start, out);
+        }
+        if (next == 0) {
+            return error_token(context, "Unterminated string");
+        } else if (next == CHAR_ESCAPE) {
             // Escape sequences
             accept(context);
             next = peek(context);
             switch (next) {
                 case CHAR_QUOTE:
                 case CHAR_ESCAPE:
-                    word_buffer[i++] = accept(context);
+                    *out++ = accept(context);
                     break;
                 default:
-                    return build_token(TOKEN_ERROR, "Invalid string escape sequence");
+                    return error_token(context, "Invalid string escape sequence");
             }
-        } else if (next == CHAR_QUOTE) {
+        } else {
+            // Closing quote
             accept(context);
             break;
-        } else {
-            word_buffer[i++] = accept(context);
         }
     }
-    word_buffer[i] = '\0';
-    return build_token(TOKEN_WORD, word_buffer);
+    lexer_token *token = build_token(context, TOKEN_WORD, start);
+    token->length = out - (context->input_buffer + start);
+    return token;
+}
+
+static lexer_token *make_quoteword(lexer_context *context) {
+    size_t start = context->position;
+    accept(context);
+    return lex_quoteword(context, start, context->input_buffer + start);
+}
+
+static lexer_token *lex_word(lexer_context *context, size_t start, char *out) {
+    while (1) {
+        accept_run(context, &out, scan_word(cursor(context), remaining(context)));
+        bool escape = peek(context) == CHAR_ESCAPE;
+        if (cut_off(context, escape ? 2 : 1)) {
+            return suspend_word(context, LEXER_IN_WORD, start, out);
+        }
+        if (!escape) {
+            break;
+        }
+        accept(context);
+        char next = peek(context);
+        if (next == CHAR_NEWLINE) {
+            // Eat newlines
+            accept(context);
+        } else if (next != 0) {
+            *out++ = accept(context);
+        }
+    }
+    lexer_token *token = build_token(context, TOKEN_WORD, start);
+    token->length = out - (context->input_buffer + start);
+    return token;
 }
 
 static lexer_token *make_word(lexer_context *context) {
-    char word_buffer[4096];
-    int i = 0;
+    size_t start = context->position;
     char current = peek(context);
-    if (!is_word_char(current) && (current != CHAR_ESCAPE)) {
-        return build_token(TOKEN_ERROR, "Bad state reading word token");
+    if (!(classify(current) & (CLASS_WORD | CLASS_ESCAPE))) {
+        return error_token(context, "Bad state reading word token");
     }
-    while (is_word_char(current) || current == CHAR_ESCAPE) {
-        if (current == CHAR_ESCAPE) {
-            accept(context);
-            char next = peek(context);
-            if (next == CHAR_NEWLINE) {
-                // Eat newlines
-                accept(context);
-            } else {
-                word_buffer[i++] = accept(context);
-            }
+    return lex_word(context, start, context->input_buffer + start);
+}
+
+// Picks a suspended word back up where the input ran out
+static lexer_token *resume_word(lexer_context *context) {
+    lexer_state state = context->state;
+    char *out = context->input_buffer + context->token_end;
+    context->state = LEXER_BETWEEN_TOKENS;
+    if (state == LEXER_IN_QUOTE) {
+        return lex_quoteword(context, context->token_start, out);
+    }
+    return lex_word(context, context->token_start, out);
+}
+
+// Skips blanks and escaped newlines between tokens
+static void skip_separators(lexer_context *context) {
+    while (1) {
+        context->position += scan_blank(cursor(context), remaining(context));
+        if (remaining(context) >= 2 && cursor(context)[0] == CHAR_ESCAPE &&
+                cursor(context)[1] == CHAR_NEWLINE) {
+            context->position += 2;
         } else {
-            word_buffer[i++] = current;
-            accept(context);
+            return;
         }
-        current = peek(context);
     }
-    word_buffer[i] = '\0';
-    return build_token(TOKEN_WORD, word_buffer);
 }
 
+// Returns NULL at the end of the input, or where it is cut off and the lexer
+// has to wait for more
 lexer_token *next_token(lexer_context *context) {
+    if (context->state != LEXER_BETWEEN_TOKENS) {
+        return resume_word(context);
+    }
+    skip_separators(context);
+
     char current = peek(context);
-    int i = 0;
-    char word_buffer[4096];
+    size_t start = context->position;
 
     if (current == 0) {
         return NULL;
     }
+    // An escape, or the first half of && or ||, needs the byte after it
+    if ((current == CHAR_ESCAPE || current == CHAR_AND || current == CHAR_OR) &&
+            cut_off(context, 2)) {
+        return NULL;
+    }
     switch (current) {
-        case CHAR_SPACE:
-            accept(context);
-            return next_token(context);
         case CHAR_NEWLINE:
             accept(context);
-            return build_token(TOKEN_NEWLINE, "<newline>");
-        case CHAR_TAB:
-            accept(context);
-            return next_token(context);
+            return build_token(context, TOKEN_NEWLINE, start);
         case CHAR_IN:
             accept(context);
-            return build_token(TOKEN_REDIR_IN, "<");
+            return build_token(context, TOKEN_REDIR_IN, start);
         case CHAR_OUT:
             accept(context);
-            return build_token(TOKEN_REDIR_OUT, ">");
+            return build_token(context, TOKEN_REDIR_OUT, start);
         case CHAR_ENDSTMT:
             accept(context);
-            return build_token(TOKEN_END_EXPR, ";");
+            return build_token(context, TOKEN_END_EXPR, start);
         case CHAR_OR:
             accept(context);
             if (peek(context) == CHAR_OR) {
                 accept(context);
-                return build_token(TOKEN_OR, "||");
+                return build_token(context, TOKEN_OR, start);
             }
-            return build_token(TOKEN_PIPE, "|");
+            return build_token(context, TOKEN_PIPE, start);
         case CHAR_AND:
             accept(context);
             if (peek(context) == CHAR_AND) {
                 accept(context);
-                return build_token(TOKEN_AND, "&&");
+                return build_token(context, TOKEN_AND, start);
             }
-            return build_token(TOKEN_BACKGROUND, "&");
+            return build_token(context, TOKEN_BACKGROUND, start);
         case CHAR_SUBSHELL_OPEN:
             accept(context);
-            return build_token(TOKEN_SUBSHELL_OPEN, "(");
+            return build_token(context, TOKEN_SUBSHELL_OPEN, start);
         case CHAR_SUBSHELL_CLOSE:
             accept(context);
-            return build_token(TOKEN_SUBSHELL_CLOSE, ")");
+            return build_token(context, TOKEN_SUBSHELL_CLOSE, start);
         case CHAR_QUOTE:
             return make_quoteword(context);
-        case CHAR_ESCAPE:
-            accept(context);
-            if (peek(context) == CHAR_NEWLINE) {
-                accept(context);
-                return next_token(context);
-            }
         default: ; 
             return make_word(context);
     }
 }
 
 
+// Lexes the rest of the input onto the end of list. Stops at the first error
+// token and returns it, or returns NULL once the input is exhausted.
+lexer_token *lex_tokens(lexer_context *context, lexer_token_list *list) {
+    long long start = stats_clock();
+    size_t count = 0;
+    lexer_token *token = next_token(context);
+    while (token) {
+        if (get_token_type(token) == TOKEN_ERROR) {
+            break;
+        }
+        add_token(list, token);
+        count++;
+        token = next_token(context);
+    }
+    count_lexing(start, count);
+    return token;
+}
+
+// Finds the end of the last complete top-level list item in input: a newline
+// outside quotes and parentheses that doesn't continue an operator. Everything
+// before the returned offset can be lexed and parsed on its own; 0 means no
+// complete item was found.
+size_t find_list_boundary(const char *input, size_t length) {
+    size_t boundary = 0;
+    size_t depth = 0;
+    bool in_quote = false;
+    bool continues = false; // Last token needs the next line to complete it
+
+    for (size_t i = 0; i < length; i++) {
+        char c = input[i];
+        if (in_quote) {
+            if (c == CHAR_ESCAPE) {
+                i++;
+            } else if (c == CHAR_QUOTE) {
+                in_quote = false;
+            }
+            continue;
+        }
+        switch (c) {
+            case CHAR_ESCAPE:
+                // An escaped newline joins lines, anything else is a word
+                if (i + 1 >= length) {
+                    return boundary;
+                }
+                i++;
+                if (input[i] != CHAR_NEWLINE) {
+                    continues = false;
+                }
+                break;
+            case CHAR_QUOTE:
+                in_quote = true;
+                continues = false;
+                break;
+            case CHAR_SUBSHELL_OPEN:
+                depth++;
+                continues = true;
+                break;
+            case CHAR_SUBSHELL_CLOSE:
+                if (depth == 0) {
+                    // Unbalanced, so nothing after this is complete either
+                    return boundary;
+                }
+                depth--;
+                continues = false;
+                break;
+            case CHAR_AND:
+                // && continues onto the next line, but a lone & ends the item
+                if (i + 1 < length && input[i + 1] == CHAR_AND) {
+                    i++;
+                    continues = true;
+                } else {
+                    continues = false;
+                }
+                break;
+            case CHAR_OR:
+            case CHAR_IN:
+            case CHAR_OUT:
+                continues = true;
+                break;
+            case CHAR_NEWLINE:
+                if (depth == 0 && !continues) {
+                    boundary = i + 1;
+                }
+                break;
+            case CHAR_SPACE:
+            case CHAR_TAB:
+                break;
+            default:
+                continues = false;
+                break;
+        }
+    }
+    return boundary;
+}
+
+
 lexer_token_list *init_token_list(void) {
     lexer_token_list *list = malloc(sizeof(lexer_token_list));
     list->contents = malloc(sizeof(lexer_token *) * TOKEN_LIST_INITIAL_CAPACITY);
     list->size = 0;
     list->capacity = TOKEN_LIST_INITIAL_CAPACITY;
+    list->cursor = 0;
     return list;
 }
 
-void restore_tokens(lexer_token_list *dest, lexer_token_list *src) {
-    dest->capacity = src->capacity;
-    dest->size = src->size;
-    dest->contents = realloc(dest->contents, sizeof(lexer_token *) * dest->capacity);
-    for (size_t i = 0; i < dest->size; i++) {
-        dest->contents[i] = src->contents[i];
-    }
-}
-
-// Frees the list itself and every token in it. Should be called on the parent token
-// list from the lexer, not by any sublists in the parser
+// Tokens themselves belong to the lexer that produced them, so freeing the list
+// only releases the list
 void free_token_list(lexer_token_list *list) {
-    for (size_t i = 0; i < list->size; i++) {
-        free_token(list->contents[i]);
-    }
-    free_token_list_container(list);
-}
-
-void free_token_list_container(lexer_token_list *list) {
     free(list->contents);
     free(list);
 }
 
-lexer_token_list *copy_token_list(lexer_token_list *list) {
-    lexer_token_list *new = malloc(sizeof(lexer_token_list));
-    new->size = list->size;
-    new->capacity = list->capacity;
-    new->contents = malloc(sizeof(lexer_token *) * new->capacity);
-    for (size_t i = 0; i < new->size; i++) {
-        new->contents[i] = list->contents[i];
-    }
-    return new;
-}
-
 void add_token(lexer_token_list *list, lexer_token *token) {
     if (list->size >= list->capacity) {
         list->capacity = list->capacity * 2;
@@ -250,34 +540,38 @@ void add_token(lexer_token_list *list, lexer_token *token) {
 }
 
 lexer_token *peek_token(lexer_token_list *list) {
-    if (list->size > 0) {
-        return list->contents[0];
+    if (list->cursor < list->size) {
+        return list->contents[list->cursor];
     }
     return NULL;
 }
 
 lexer_token *consume_token(lexer_token_list *list) {
-    if (list->size > 0) {
-        lexer_token *ret = list->contents[0];
-        for (size_t i = 0; i < list->size - 1; i++) {
-            list->contents[i] = list->contents[i + 1];
-        }
-        list->size--;
-        return ret;
+    if (list->cursor < list->size) {
+        return list->contents[list->cursor++];
     }
     return NULL;
 }
 
+// Consuming never discards tokens, so backtracking is just moving the cursor
+size_t mark_tokens(lexer_token_list *list) {
+    return list->cursor;
+}
+
+void rewind_tokens(lexer_token_list *list, size_t mark) {
+    list->cursor = mark;
+}
+
 bool token_list_empty(lexer_token_list *list) {
-    return list->size == 0;
+    return list->cursor >= list->size;
 }
 
 static void print_token(lexer_token *token) {
-    printf("%s\n", get_token_value(token));
+    printf("%.*s\n", (int) get_token_length(token), get_token_value(token));
 }
 
 void print_token_list(lexer_token_list *list) {
-    for (size_t i = 0; i < list->size; i++) {
+    for (size_t i = list->cursor; i < list->size; i++) {
         print_token(list->contents[i]);
     }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 // Operators and shell tokens
 #define CHAR_AND '&'
@@ -52,27 +53,34 @@ typedef enum token_type token_type;
 // Token operations
 
 lexer_context *init_lexer(char *input);
+lexer_context *init_lexer_borrowed(char *input, size_t length);
+lexer_context *init_lexer_resumable(void);
+void lexer_feed(lexer_context *context, char *input, size_t length);
+void lexer_finish(lexer_context *context);
+bool lexer_needs_input(lexer_context *context);
 lexer_token *next_token(lexer_context *context);
 void free_lexer(lexer_context *lexer);
 
+size_t find_list_boundary(const char *input, size_t length);
+
 char *get_token_value(lexer_token *token);
+size_t get_token_length(lexer_token *token);
 token_type get_token_type(lexer_token *token);
-void free_token(lexer_token *token);
 
 // Token list operations
 
 lexer_token_list *init_token_list(void);
 void free_token_list(lexer_token_list *list);
-void free_token_list_container(lexer_token_list *list);
-
-lexer_token_list *copy_token_list(lexer_token_list *list);
-void restore_tokens(lexer_token_list *dest, lexer_token_list *src);
 
 void add_token(lexer_token_list *list, lexer_token *token);
+lexer_token *lex_tokens(lexer_context *context, lexer_token_list *list);
 
 lexer_token *peek_token(lexer_token_list *list);
 lexer_token *consume_token(lexer_token_list *list);
 
+size_t mark_tokens(lexer_token_list *list);
+void rewind_tokens(lexer_token_list *list, size_t mark);
+
 bool token_list_empty(lexer_token_list *list);
 
 void print_token_list(lexer_token_list *list);
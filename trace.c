@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "trace.h"
+#include "util.h"
+
+
+#define TRACE_ENV "NUSH_TRACE"
+
+// Events are written out once this much has been gathered
+#define TRACE_FLUSH_SIZE (64 * 1024)
+
+
+// A process started but not yet reaped
+struct traced_process {
+    pid_t pid;
+    long long start;
+    const char *category;
+    char *name;
+    char **argv;
+};
+typedef struct traced_process traced_process;
+
+// A forked child inherits the shell's buffer and processes, which are the
+// shell's to write, so it starts afresh the first time it records anything
+struct trace_state {
+    int fd;
+    pid_t owner;
+    string_buffer *events;
+    traced_process *processes;
+    size_t count;
+    size_t capacity;
+};
+typedef struct trace_state trace_state;
+
+static trace_state trace = {.fd = -1};
+
+
+void flush_trace(void) {
+    if (trace.fd == -1 || trace.owner != getpid()) {
+        return;
+    }
+    // Each flush is one write to a file opened for appending, so the events of
+    // processes sharing it never interleave
+    write_all(trace.fd, string_buffer_contents(trace.events), string_buffer_length(trace.events));
+    reset_string_buffer(trace.events);
+}
+
+static void forget_parent_processes(void) {
+    for (size_t i = 0; i < trace.count; i++) {
+        free(trace.processes[i].name);
+        for (size_t j = 0; trace.processes[i].argv && trace.processes[i].argv[j]; j++) {
+            free(trace.processes[i].argv[j]);
+        }
+        free(trace.processes[i].argv);
+    }
+    trace.count = 0;
+}
+
+static void take_trace(void) {
+    pid_t self = getpid();
+    if (trace.owner != self) {
+        reset_string_buffer(trace.events);
+        forget_parent_processes();
+        trace.owner = self;
+    }
+}
+
+void init_tracing(const char *path) {
+    if (!path) {
+        path = getenv(TRACE_ENV);
+    }
+    if (!path || !*path) {
+        return;
+    }
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace.fd == -1) {
+        perror(path);
+        return;
+    }
+    trace.owner = getpid();
+    trace.events = init_string_buffer();
+    trace.capacity = 16;
+    trace.processes = malloc(sizeof(traced_process) * trace.capacity);
+    // The closing bracket is optional, which lets children outlive the shell
+    write_all(trace.fd, "[\n", 2);
+    atexit(flush_trace);
+}
+
+bool tracing(void) {
+    return trace.fd != -1;
+}
+
+long long trace_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+
+static void push_char(string_buffer *buffer, char c) {
+    push_string(buffer, &c, 1);
+}
+
+static void push_json_string(string_buffer *buffer, const char *str) {
+    push_char(buffer, '"');
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            push_char(buffer, '\\');
+            push_char(buffer, c);
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            push_string(buffer, escape, strlen(escape));
+        } else {
+            push_char(buffer, c);
+        }
+    }
+    push_char(buffer, '"');
+}
+
+// Adds "key": to an object, after a comma unless it's the first
+static void push_key(string_buffer *buffer, const char *key) {
+    size_t length = string_buffer_length(buffer);
+    if (length > 0 && string_buffer_contents(buffer)[length - 1] != '{') {
+        push_char(buffer, ',');
+    }
+    push_json_string(buffer, key);
+    push_char(buffer, ':');
+}
+
+static void push_number(string_buffer *buffer, const char *key, long long value) {
+    char number[32];
+    int length = snprintf(number, sizeof(number), "%lld", value);
+    push_key(buffer, key);
+    push_string(buffer, number, length);
+}
+
+// Starts a complete event, leaving its args open for the caller to fill in
+static void begin_event(const char *category, const char *name, long long start,
+                        long long end, pid_t tid) {
+    string_buffer *events = trace.events;
+    push_char(events, '{');
+    push_key(events, "name");
+    push_json_string(events, name);
+    push_key(events, "cat");
+    push_json_string(events, category);
+    push_key(events, "ph");
+    push_json_string(events, "X");
+    push_number(events, "ts", start);
+    push_number(events, "dur", end - start);
+    push_number(events, "pid", trace.owner);
+    push_number(events, "tid", tid);
+    push_key(events, "args");
+    push_char(events, '{');
+}
+
+static void end_event(void) {
+    push_string(trace.events, "}},\n", 4);
+    if (string_buffer_length(trace.events) >= TRACE_FLUSH_SIZE) {
+        flush_trace();
+    }
+}
+
+static long long microseconds(const struct timeval *time) {
+    return time->tv_sec * 1000000LL + time->tv_usec;
+}
+
+
+void trace_spawned(pid_t pid, const char *category, const char *name, char **argv) {
+    if (!tracing() || pid <= 0) {
+        return;
+    }
+    take_trace();
+    if (trace.count == trace.capacity) {
+        trace.capacity = trace.capacity * 2;
+        trace.processes = realloc(trace.processes, sizeof(traced_process) * trace.capacity);
+    }
+    traced_process *process = &trace.processes[trace.count++];
+    process->pid = pid;
+    process->start = trace_clock();
+    process->category = category;
+    process->argv = NULL;
+    if (argv) {
+        size_t count = 0;
+        while (argv[count]) {
+            count++;
+        }
+        process->argv = malloc(sizeof(char *) * (count + 1));
+        string_buffer *joined = init_string_buffer();
+        for (size_t i = 0; i < count; i++) {
+            process->argv[i] = strdup(argv[i]);
+            if (i > 0) {
+                push_char(joined, ' ');
+            }
+            push_string(joined, argv[i], strlen(argv[i]));
+        }
+        process->argv[count] = NULL;
+        process->name = strdup(string_buffer_contents(joined));
+        free_string_buffer(joined);
+    } else {
+        process->name = strdup(name);
+    }
+}
+
+void trace_reaped(pid_t pid, int status, const struct rusage *usage) {
+    if (!tracing()) {
+        return;
+    }
+    take_trace();
+    for (size_t i = 0; i < trace.count; i++) {
+        traced_process *process = &trace.processes[i];
+        if (process->pid != pid) {
+            continue;
+        }
+        begin_event(process->category, process->name, process->start, trace_clock(), pid);
+        string_buffer *events = trace.events;
+        if (process->argv) {
+            push_key(events, "argv");
+            push_char(events, '[');
+            for (size_t j = 0; process->argv[j]; j++) {
+                if (j > 0) {
+                    push_char(events, ',');
+                }
+                push_json_string(events, process->argv[j]);
+                free(process->argv[j]);
+            }
+            push_char(events, ']');
+            free(process->argv);
+        }
+        push_number(events, "pid", pid);
+        push_number(events, "status", exit_status(status));
+        push_number(events, "user_us", microseconds(&usage->ru_utime));
+        push_number(events, "sys_us", microseconds(&usage->ru_stime));
+        push_number(events, "max_rss_kb", usage->ru_maxrss);
+        end_event();
+
+        free(process->name);
+        trace.processes[i] = trace.processes[--trace.count];
+        return;
+    }
+}
+
+void trace_span(const char *category, const char *name, long long start, int status) {
+    if (!tracing()) {
+        return;
+    }
+    take_trace();
+    begin_event(category, name, start, trace_clock(), trace.owner);
+    push_number(trace.events, "status", status);
+    end_event();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+
+// Tracing records a span for every command, subshell, pipeline and background
+// job the shell runs, in Chrome's trace event format, which chrome://tracing
+// and Perfetto show on a timeline. Spans for processes carry the exit status
+// and the CPU time and peak memory wait4 reports. Events are gathered in a
+// buffer and appended to the file in large writes. Children of the shell
+// append their own, so a trace covers subshells and scripts run with -P too.
+
+// Starts tracing to path, or to $NUSH_TRACE if path is NULL. Does nothing if
+// neither is set.
+void init_tracing(const char *path);
+
+bool tracing(void);
+
+// Writes out the events gathered so far, if this process has any. The shell
+// does so at exit, and a forked child must before it leaves.
+void flush_trace(void);
+
+// Microseconds on the clock the trace uses
+long long trace_clock(void);
+
+// Notes that a process was started for argv, or for a span called name if
+// argv is NULL. Its span ends when trace_reaped is called for it.
+void trace_spawned(pid_t pid, const char *category, const char *name, char **argv);
+void trace_reaped(pid_t pid, int status, const struct rusage *usage);
+
+// A span the shell already has both ends of, such as a builtin run in the
+// shell or a whole pipeline
+void trace_span(const char *category, const char *name, long long start, int status);
@@ -1,80 +1,245 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "util.h"
+#include <fcntl.h>
+#include <unistd.h>
 
-#define BUFFER_ALLOC_CAPACITY 10
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
+#include "stats.h"
+#include "util.h"
+
+#define BUFFER_INITIAL_CAPACITY 256
 
-struct string_part {
-    char *content; // String content (not null-terminated)
-    size_t length;
-};
-typedef struct string_part string_part;
 
+// Contents are kept null-terminated, so there's always room for one more byte
 struct string_buffer {
-    size_t size;
+    char *data;
+    size_t length;
     size_t capacity;
-    string_part **parts;
 };
 
 
 string_buffer *init_string_buffer(void) {
     string_buffer *buffer = malloc(sizeof(string_buffer));
-    buffer->capacity = BUFFER_ALLOC_CAPACITY;
-    buffer->parts = malloc(sizeof(string_part *) * buffer->capacity);
-    buffer->size = 0;
+    buffer->capacity = BUFFER_INITIAL_CAPACITY;
+    buffer->data = malloc(sizeof(char) * buffer->capacity);
+    buffer->data[0] = '\0';
+    buffer->length = 0;
     return buffer;
 }
 
 void free_string_buffer(string_buffer *buffer) {
-    for (int i = 0; i < buffer->size; i++) {
-        free(buffer->parts[i]->content);
-        free(buffer->parts[i]);
-    }
-    free(buffer->parts);
+    free(buffer->data);
     free(buffer);
 }
 
-static string_part *make_part(char *content) {
-    string_part *part = malloc(sizeof(string_part));
-    part->length = strlen(content);
-    part->content = malloc(sizeof(char) * part->length);
-    memcpy(part->content, content, sizeof(char) * part->length);
-    return part;
+void push_string(string_buffer *buffer, const char *str, size_t length) {
+    if (buffer->length + length >= buffer->capacity) {
+        while (buffer->length + length >= buffer->capacity) {
+            buffer->capacity = buffer->capacity * 2;
+        }
+        buffer->data = realloc(buffer->data, sizeof(char) * buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->length, str, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
+
+// The buffer's own storage, which stays valid until it is next changed
+char *string_buffer_contents(string_buffer *buffer) {
+    return buffer->data;
+}
+
+size_t string_buffer_length(string_buffer *buffer) {
+    return buffer->length;
 }
 
-static void append_part(string_buffer *buffer, string_part *part) {
-    if (buffer->size >= buffer->capacity) {
-        buffer->capacity = buffer->capacity * 2;
-        buffer->parts = realloc(buffer->parts, sizeof(string_part *) * buffer->capacity);
+// Empties the buffer but keeps its storage for reuse
+void reset_string_buffer(string_buffer *buffer) {
+    buffer->length = 0;
+    buffer->data[0] = '\0';
+}
+
+
+// FNV-1a, for the shell's small string-keyed tables
+size_t hash_string(const char *str) {
+    size_t hash = 14695981039346656037UL;
+    for (; *str; str++) {
+        hash = (hash ^ (unsigned char) *str) * 1099511628211UL;
     }
+    return hash;
+}
+
 
-    buffer->parts[buffer->size] = part;
-    buffer->size++;
+bool write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t count = write(fd, data, length);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
 }
 
-void push_string(string_buffer *buffer, char *str) {
-    string_part *part = make_part(str);
-    append_part(buffer, part);
+int open_temporary_file(void) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) {
+        dir = "/tmp";
+    }
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd != -1) {
+        return fd;
+    }
+
+    // The file system doesn't support O_TMPFILE
+    char *path = malloc(strlen(dir) + sizeof("/nush.XXXXXX"));
+    sprintf(path, "%s/nush.XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1) {
+        unlink(path);
+    }
+    free(path);
+    return fd;
 }
 
-size_t string_buffer_size(string_buffer *buffer) {
-    size_t size = 0;
-    for (int i = 0; i < buffer->size; i++) {
-        size += buffer->parts[i]->length;
+#define COPY_CHUNK_SIZE (64 * 1024)
+
+// sendfile copies in the kernel when it can
+bool copy_file_contents(int from, int to) {
+    if (lseek(from, 0, SEEK_SET) == -1) {
+        return false;
+    }
+    while (1) {
+        ssize_t count = sendfile(to, from, NULL, 1 << 30);
+        if (count == 0) {
+            return true;
+        }
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count == -1) {
+            break;
+        }
     }
-    return size;
+    if (errno != EINVAL && errno != ENOSYS) {
+        return false;
+    }
+
+    char buffer[COPY_CHUNK_SIZE];
+    while (1) {
+        ssize_t count = read(from, buffer, sizeof(buffer));
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return count == 0;
+        }
+        if (!write_all(to, buffer, count)) {
+            return false;
+        }
+    }
+}
+
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT (sizeof(max_align_t))
+
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t capacity;
+    max_align_t data[];
+};
+typedef struct arena_block arena_block;
+
+struct arena {
+    arena_block *blocks;
+
+    // Arenas adopted by this one, released along with it
+    struct arena *adopted;
+    struct arena *next_adopted;
+};
+
+
+arena *init_arena(void) {
+    arena *arena = malloc(sizeof(struct arena));
+    arena->blocks = NULL;
+    arena->adopted = NULL;
+    arena->next_adopted = NULL;
+    return arena;
+}
+
+void free_arena(arena *arena) {
+    arena_block *block = arena->blocks;
+    while (block) {
+        arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    struct arena *adopted = arena->adopted;
+    while (adopted) {
+        struct arena *next = adopted->next_adopted;
+        free_arena(adopted);
+        adopted = next;
+    }
+    free(arena);
 }
 
-char *build_string(string_buffer *buffer) {
-    char *buf = malloc(sizeof(char) * string_buffer_size(buffer) + 1);
-    size_t offset = 0;
-    for (int i = 0; i < buffer->size; i++) {
-        memcpy(buf + offset, buffer->parts[i]->content, buffer->parts[i]->length);
-        offset += buffer->parts[i]->length;
+// Ties child's lifetime to parent's. Allocations in child stay valid and child
+// can still be allocated from, but only parent may be freed from then on.
+void arena_adopt(arena *parent, arena *child) {
+    child->next_adopted = parent->adopted;
+    parent->adopted = child;
+}
+
+static arena_block *add_block(arena *arena, size_t capacity) {
+    arena_block *block = malloc(sizeof(arena_block) + capacity);
+    count_allocation(sizeof(arena_block) + capacity);
+    block->used = 0;
+    block->capacity = capacity;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block;
+}
+
+void *arena_alloc(arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    arena_block *block = arena->blocks;
+    if (!block || block->capacity - block->used < size) {
+        if (size > ARENA_BLOCK_SIZE / 4) {
+            // Oversized requests get a block of their own, behind the current one,
+            // so the space left in the current block isn't wasted
+            arena_block *current = arena->blocks;
+            block = add_block(arena, size);
+            if (current) {
+                arena->blocks = current;
+                block->next = current->next;
+                current->next = block;
+            }
+        } else {
+            block = add_block(arena, ARENA_BLOCK_SIZE);
+        }
     }
-    buf[offset] = 0;
-    return buf;
+    void *ptr = (char *) block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arena_strndup(arena *arena, const char *str, size_t length) {
+    char *copy = arena_alloc(arena, sizeof(char) * length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
 }
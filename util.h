@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 
 struct string_buffer;
 typedef struct string_buffer string_buffer;
@@ -8,5 +11,35 @@ typedef struct string_buffer string_buffer;
 string_buffer *init_string_buffer(void);
 void free_string_buffer(string_buffer *buffer);
 
-void push_string(string_buffer *buffer, char *str);
-char *build_string(string_buffer *buffer);
+void push_string(string_buffer *buffer, const char *str, size_t length);
+char *string_buffer_contents(string_buffer *buffer);
+size_t string_buffer_length(string_buffer *buffer);
+void reset_string_buffer(string_buffer *buffer);
+
+
+size_t hash_string(const char *str);
+
+
+// Files
+
+bool write_all(int fd, const char *data, size_t length);
+
+// An unnamed file in $TMPDIR or /tmp, which is gone once it's closed. Returns
+// -1 if it couldn't be created.
+int open_temporary_file(void);
+
+// Writes everything in the file from to the descriptor to, from the start
+bool copy_file_contents(int from, int to);
+
+
+// Bump allocator whose allocations are all released together
+
+struct arena;
+typedef struct arena arena;
+
+arena *init_arena(void);
+void free_arena(arena *arena);
+void arena_adopt(arena *parent, arena *child);
+
+void *arena_alloc(arena *arena, size_t size);
+char *arena_strndup(arena *arena, const char *str, size_t length);